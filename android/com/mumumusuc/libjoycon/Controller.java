@@ -94,6 +94,12 @@ public final class Controller {
         set_player(mHandle, player, flash);
     }
 
+    // Called with each input report the hid host receives from the device, it is dispatched
+    // right away on the calling thread.
+    public int onReport(byte[] report) {
+        return feed(mHandle, report);
+    }
+
     @Override
     protected void finalize() throws Throwable {
         super.finalize();
@@ -122,6 +128,8 @@ public final class Controller {
 
     private native int rumblef(long handle, float hf_l, float hfa_l, float lf_l, float lfa_l, float hf_r, float hfa_r, float lf_r, float lfa_r);
 
+    private native int feed(long handle, byte[] report);
+
     static {
         System.loadLibrary("joycon");
         classInitNative();
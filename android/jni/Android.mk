@@ -10,5 +10,7 @@ LOCAL_C_INCLUDES := ../../include
 LOCAL_SRC_FILES := 			\
 	../../src/session2.cc 		\
 	../../src/controller.cc	\
+	../../src/hidraw.cc		\
+	../../src/stick.cc		\
 	joycon_jni.cc
 include $(BUILD_SHARED_LIBRARY)
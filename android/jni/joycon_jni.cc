@@ -25,7 +25,9 @@
 #include <errno.h>
 #include <jni.h>
 #include <memory>
+#include <mutex>
 #include <unistd.h>
+#include <vector>
 
 #define CLASS_NAME "com/mumumusuc/libjoycon/Controller"
 #define NELEM(m) (sizeof((m)) / sizeof(JNINativeMethod))
@@ -46,6 +48,7 @@ static jint set_player(JNIEnv *, jobject, jlong, jbyte, jbyte);
 static jint set_rumble(JNIEnv *, jobject, jlong, jboolean);
 static jint rumble(JNIEnv *, jobject, long, jshort, jbyte, jbyte, jbyte, jbyte, jbyte, jbyte, jbyte);
 static jint rumblef(JNIEnv *, jobject, jlong, jfloat, jfloat, jfloat, jfloat, jfloat, jfloat, jfloat, jfloat);
+static jint feed(JNIEnv *, jobject, jlong, jbyteArray);
 static void classInitNative(JNIEnv *env, jclass clazz) {
     method_setReport = env->GetMethodID(clazz, "setReport", "(Ljava/lang/String;)V");
     method_sendData = env->GetMethodID(clazz, "sendData", "(Ljava/lang/String;)V");
@@ -60,6 +63,7 @@ static JNINativeMethod sMethods[] = {
     {"set_rumble", "(JZ)I", (void *)set_rumble},
     {"rumble", "(JBBBBBBBB)I", (void *)rumble},
     {"rumblef", "(JFFFFFFFF)I", (void *)rumblef},
+    {"feed", "(J[B)I", (void *)feed},
 };
 
 static inline int jniRegisterNativeMethod(JNIEnv *env, const char *class_name, const JNINativeMethod *methods, int size) {
@@ -116,22 +120,47 @@ static ssize_t send(const void *buffer, size_t len) {
     return OUTPUT_REPORT_SIZE;
 }
 
-static ssize_t recv(void *buffer, size_t len) {
-    //debug("%s not implemented", __func__);
-    usleep(1000 * 16);
-    return 0;
-}
-
+// Reports come from the java side by callback, they are fed to the sessions instead of being
+// read by a poll thread.
 static const Device sDevice = {
     .desc = sNintendoSwitch,
     .func = {
         .sender = send,
-        .recver = recv,
+        .recver = nullptr,
         .send_size = OUTPUT_REPORT_SIZE,
         .recv_size = INPUT_REPORT_STAND_SIZE,
     },
 };
 
+// Owned by the controller and deleted through ControllerImpl.
+class JniImpl : public ControllerImpl {
+  private:
+    // owned by the controller, which deletes them before its impl
+    std::vector<session::Session *> sessions_;
+
+  protected:
+    session::Session *OpenDevice(unsigned int, ...) override {
+        auto sess = new session::Session(&sDevice.func, nullptr, push_type_);
+        sessions_.push_back(sess);
+        return sess;
+    }
+
+  public:
+    explicit JniImpl(const Device *host) : ControllerImpl(host){};
+    // a JoyCon_Dual has the left session first, reports tell their side by category
+    ssize_t Feed(const void *report, size_t size) {
+        if (sessions_.empty() || size == 0)
+            return -EINVAL;
+        auto input = reinterpret_cast<const InputReport *>(report);
+        size_t index = sessions_.size() > 1 && size > 2 && input->controller_state.category == JOYCON_R ? 1 : 0;
+        return sessions_[index]->Feed(report, size);
+    }
+};
+
+// feed() may race with destroy()
+static std::mutex g_lock;
+static JniImpl *g_impl = nullptr;
+
 static jlong create(JNIEnv *env, jobject object, jint category) {
     Controller *handle = nullptr;
     if (category < PRO_GRIP || category > JOYCON) {
@@ -140,17 +169,27 @@ static jlong create(JNIEnv *env, jobject object, jint category) {
     }
     env->GetJavaVM(&g_vm);
     g_obj = env->NewGlobalRef(object);
-    switch (category) {
-    case PRO_GRIP:
-        handle = new ProController(sDevice);
-    case JOYCON_L:
-        handle = new JoyCon_L(sDevice);
-    case JOYCON_R:
-        handle = new JoyCon_R(sDevice);
-    case JOYCON:
-        handle = new JoyCon_Dual(sDevice);
-    default:
-        break;
+    {
+        std::lock_guard<std::mutex> lock(g_lock);
+        g_impl = new JniImpl(&sDevice);
+        switch (category) {
+        case PRO_GRIP:
+            handle = new ProController(g_impl);
+            break;
+        case JOYCON_L:
+            handle = new JoyCon_L(g_impl);
+            break;
+        case JOYCON_R:
+            handle = new JoyCon_R(g_impl);
+            break;
+        case JOYCON:
+            handle = new JoyCon_Dual(g_impl);
+            break;
+        default:
+            delete g_impl;
+            g_impl = nullptr;
+            break;
+        }
     }
 done:
     return reinterpret_cast<jlong>(handle);
@@ -158,11 +197,27 @@ done:
 
 static void destroy(JNIEnv *env, jobject object, jlong handle) {
     auto controller = reinterpret_cast<controller::Controller *>(handle);
+    {
+        std::lock_guard<std::mutex> lock(g_lock);
+        g_impl = nullptr;
+    }
     delete controller;
     env->DeleteGlobalRef(g_obj);
     g_vm = nullptr;
 }
 
+static jint feed(JNIEnv *env, jobject object, jlong handle, jbyteArray report) {
+    uint8_t buffer[INPUT_REPORT_LARGE_SIZE];
+    jsize size = env->GetArrayLength(report);
+    if (size > jsize(sizeof(buffer)))
+        size = sizeof(buffer);
+    env->GetByteArrayRegion(report, 0, size, reinterpret_cast<jbyte *>(buffer));
+    std::lock_guard<std::mutex> lock(g_lock);
+    if (!g_impl)
+        return -EPIPE;
+    return g_impl->Feed(buffer, size);
+}
+
 static jint poll(JNIEnv *env, jobject object, jlong handle, jbyte type) {
     auto controller = reinterpret_cast<controller::Controller *>(handle);
     return controller->Poll(PollType(type));
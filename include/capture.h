@@ -0,0 +1,123 @@
+/*
+ *   Copyright (c) 2020 mumumusuc
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "device.h"
+#include <stdint.h>
+
+#define CAPTURE_MAGIC 0x5041434a // "JCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_OUTPUT 0
+#define CAPTURE_INPUT 1
+
+#pragma pack(1)
+
+// A capture is the header followed by records, each padded to 8 bytes so the records of a
+// mapped file are aligned. Records are only appended, a capture cut short is still readable
+// up to its last whole record.
+typedef struct CaptureHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t _;
+    uint64_t start; // CLOCK_MONOTONIC ns when recording began
+} capture_header_t;
+STATIC_ASSERT(sizeof(CaptureHeader) == 16, "sizeof CaptureHeader == 16");
+
+typedef struct CaptureRecord {
+    uint64_t time; // ns since start
+    uint16_t size; // of data
+    uint8_t dir;   // CAPTURE_OUTPUT or CAPTURE_INPUT
+    uint8_t _[5];
+    uint8_t data[0];
+} capture_record_t;
+STATIC_ASSERT(sizeof(CaptureRecord) == 16, "sizeof CaptureRecord == 16");
+
+#pragma pack()
+
+#define capture_record_size(size) ((sizeof(CaptureRecord) + (size) + 7) & ~size_t(7))
+
+#ifdef __cplusplus
+#include <mutex>
+
+namespace capture {
+
+// Wraps a DeviceFunc and appends every report sent and received to a capture file. poll_fd
+// and waker are passed through.
+class Recorder {
+  private:
+    DeviceFunc remote_;
+    std::mutex lock_;
+    int fd_;
+    uint64_t start_;
+
+    void Append(uint8_t dir, const void *, size_t);
+
+  public:
+    // throws std::runtime_error if the file can not be created
+    Recorder(const char *path, const DeviceFunc &remote);
+    ~Recorder();
+    Recorder(const Recorder &) = delete;
+    Recorder &operator=(const Recorder &) = delete;
+    // The Recorder must outlive sessions built over it.
+    DeviceFunc Func();
+};
+
+enum ReplayMode {
+    REPLAY_TIMED, // input reports at their recorded times
+    REPLAY_FAST,  // input reports as fast as the session takes them
+};
+
+// Feeds the input reports of a mapped capture back to a session. poll_fd is a timerfd armed
+// for the next report, so replay works on a Reactor too. Output reports sent are counted and
+// dropped.
+class Replay {
+  private:
+    const ReplayMode mode_;
+    size_t size_;
+    uint8_t *map_;
+    size_t offset_;
+    size_t inputs_;
+    size_t fed_;
+    size_t sent_;
+    int timer_fd_;
+    uint64_t start_;
+    std::mutex lock_;
+
+    const CaptureRecord *Next();
+    void Arm();
+    ssize_t Recv(void *, size_t);
+
+  public:
+    // throws std::runtime_error if the file is not a capture
+    Replay(const char *path, ReplayMode mode = REPLAY_TIMED);
+    ~Replay();
+    Replay(const Replay &) = delete;
+    Replay &operator=(const Replay &) = delete;
+    // The Replay must outlive sessions built over it, replay starts when Func() is called.
+    DeviceFunc Func(size_t recv_size);
+    size_t inputs() const { return inputs_; };
+    size_t fed();
+    size_t sent();
+    bool Done();
+};
+
+} // namespace capture
+
+#endif // __cplusplus
+#endif // CAPTURE_H
@@ -23,6 +23,7 @@
 #include "mcu.h"
 #include "output_report.h"
 #include "session2.h"
+#include "stick.h"
 
 #ifdef __cplusplus
 #include <functional>
@@ -58,6 +59,19 @@ class Controller {
     virtual int BackupMemory(Progress progress) = 0;
     virtual int RestoreMemory(Progress progress) = 0;
     virtual int GetData(ControllerData &data) = 0;
+    // Latest data decoded by the poll threads, without locks or waiting. Returns WAITING
+    // before the first report.
+    virtual int GetState(ControllerData &data) = 0;
+    // Wait up to timeout ms for the next report, a JoyCon_Dual waits for its left side.
+    virtual int WaitState(ControllerData &data, unsigned timeout) = 0;
+    // Read the factory stick calibration from flash, Pair() does it once connected and keeps
+    // the nominal one if that fails. deadzone is a raw distance from center.
+    virtual int Calibrate(uint16_t deadzone) = 0;
+    // sticks of the latest state, calibrated and normalized to [-STICK_MAX, STICK_MAX]
+    virtual int GetSticks(Sticks &sticks) = 0;
+    // Move up to count button edges, seen by the poll threads since the last call, to events
+    // ordered by time. Returns the number moved.
+    virtual size_t GetButtonEvents(session::ButtonEvent *events, size_t count) = 0;
     virtual int GetColor(ControllerColor &color) = 0;
     virtual int SetColor(const ControllerColor &color) = 0;
     virtual int SetPlayer(Player player, PlayerFlash flash) = 0;
@@ -67,6 +81,12 @@ class Controller {
     virtual int SetRumble(bool enable) = 0;
     virtual int Rumble(const rumble_data_t *left, const rumble_data_t *right) = 0;
     virtual int Rumblef(const rumble_data_f_t *left, const rumble_data_f_t *right) = 0;
+    // Pipeline the commands issued until Commit(), at most `window` of them in flight.
+    // Pipelined commands return WAITING, Commit() waits for all of them and returns the
+    // first failure. Commands reading data back still wait for their own reply, so does Pair()
+    // which reads the stick calibration next.
+    virtual int Begin(unsigned window) = 0;
+    virtual int Commit() = 0;
 };
 
 class ControllerImpl {
@@ -75,18 +95,37 @@ class ControllerImpl {
     friend class JoyCon_L;
     friend class JoyCon_R;
     friend class JoyCon_Dual;
-    std::vector<std::future<session::Result>> results_;
+    // commands in flight, oldest first, each owns `count` futures at the front of results_
+    struct Pending {
+        session::Route route;
+        size_t count;
+    };
+    std::vector<session::Future> results_;
+    std::vector<Pending> pending_;
+    unsigned window_;
+    int batch_ret_;
     std::mutex sess_lock_;
     std::mutex output_lock_;
+    // serializes the sender of host_ shared by the push threads of QUEUED sessions
+    std::mutex send_lock_;
     OutputReport *output_;
     Device host_;
+    // Calibrate() may run while GetSticks() decodes
+    std::mutex sticks_lock_;
+    StickDecoder sticks_;
 
   protected:
+    // push of the sessions opened, JoyCon_Dual queues its reports so both sides send at once
+    session::PushType push_type_;
     explicit ControllerImpl(const Device *);
-    virtual session::Session *OpenDevice(unsigned int, ...) { return new session::Session(&host_.func); };
+    virtual session::Session *OpenDevice(unsigned int, ...);
     template <typename... Args>
-    void Transmit(unsigned, const void *, session::Inspector, const Args &...);
+    void Transmit(unsigned, const void *, session::Route, session::Inspector, const Args &...);
     int Await();
+    int Retire();
+    int Defer();
+    int Begin(unsigned);
+    int Commit();
     template <typename... Args>
     int ReadMemory(uint32_t, uint8_t, void *, const Args &...);
     template <typename... Args>
@@ -102,6 +141,15 @@ class ControllerImpl {
     template <typename... Args>
     int GetData(ControllerData &, const Args &...);
     template <typename... Args>
+    int GetState(ControllerData &, const Args &...);
+    template <typename T, typename... Args>
+    int WaitState(ControllerData &, unsigned, const T &, const Args &...);
+    int Calibrate(uint16_t, session::Session *, session::Session *);
+    template <typename... Args>
+    int GetSticks(Sticks &, const Args &...);
+    template <typename... Args>
+    size_t GetButtonEvents(session::ButtonEvent *, size_t, const Args &...);
+    template <typename... Args>
     int GetColor(ControllerColor &, const Args &...);
     template <typename... Args>
     int SetColor(const ControllerColor &, const Args &...);
@@ -151,7 +199,7 @@ class ControllerImpl {
     int TestIR(int, uint8_t *, IrCallback, const Args &...);
 
   public:
-    ~ControllerImpl();
+    virtual ~ControllerImpl();
 };
 
 class JoyCon_L : public Controller {
@@ -169,6 +217,11 @@ class JoyCon_L : public Controller {
     int BackupMemory(Progress progress) override;
     int RestoreMemory(Progress progress) override;
     int GetData(ControllerData &data) override;
+    int GetState(ControllerData &data) override;
+    int WaitState(ControllerData &data, unsigned timeout) override;
+    int Calibrate(uint16_t deadzone) override;
+    int GetSticks(Sticks &sticks) override;
+    size_t GetButtonEvents(session::ButtonEvent *events, size_t count) override;
     int GetColor(ControllerColor &color) override;
     int SetColor(const ControllerColor &color) override;
     int SetLowPower(bool enable) override;
@@ -177,6 +230,8 @@ class JoyCon_L : public Controller {
     int SetRumble(bool enable) override;
     int Rumble(const rumble_data_t *left, const rumble_data_t *right) override;
     int Rumblef(const rumble_data_f_t *left, const rumble_data_f_t *right) override;
+    int Begin(unsigned window) override;
+    int Commit() override;
 };
 
 class JoyCon_R : public Controller {
@@ -194,6 +249,11 @@ class JoyCon_R : public Controller {
     int BackupMemory(Progress progress) override;
     int RestoreMemory(Progress progress) override;
     int GetData(ControllerData &data) override;
+    int GetState(ControllerData &data) override;
+    int WaitState(ControllerData &data, unsigned timeout) override;
+    int Calibrate(uint16_t deadzone) override;
+    int GetSticks(Sticks &sticks) override;
+    size_t GetButtonEvents(session::ButtonEvent *events, size_t count) override;
     int GetColor(ControllerColor &color) override;
     int SetColor(const ControllerColor &color) override;
     int SetLowPower(bool enable) override;
@@ -202,6 +262,8 @@ class JoyCon_R : public Controller {
     int SetRumble(bool enable) override;
     int Rumble(const rumble_data_t *left, const rumble_data_t *right) override;
     int Rumblef(const rumble_data_f_t *left, const rumble_data_f_t *right) override;
+    int Begin(unsigned window) override;
+    int Commit() override;
     int SetMcuState(McuState state);
     int SetMcuMode(McuMode mode);
     int CheckMcuMode(McuMode mode);
@@ -233,6 +295,11 @@ class ProController : public Controller {
     int BackupMemory(Progress progress) override;
     int RestoreMemory(Progress progress) override;
     int GetData(ControllerData &data) override;
+    int GetState(ControllerData &data) override;
+    int WaitState(ControllerData &data, unsigned timeout) override;
+    int Calibrate(uint16_t deadzone) override;
+    int GetSticks(Sticks &sticks) override;
+    size_t GetButtonEvents(session::ButtonEvent *events, size_t count) override;
     int GetColor(ControllerColor &color) override;
     int SetColor(const ControllerColor &color) override;
     int SetLowPower(bool enable) override;
@@ -241,6 +308,8 @@ class ProController : public Controller {
     int SetRumble(bool enable) override;
     int Rumble(const rumble_data_t *left, const rumble_data_t *right) override;
     int Rumblef(const rumble_data_f_t *left, const rumble_data_f_t *right) override;
+    int Begin(unsigned window) override;
+    int Commit() override;
     int SetMcuState(McuState state);
     int SetMcuMode(McuMode mode);
     int CheckMcuMode(McuMode mode);
@@ -265,6 +334,11 @@ class JoyCon_Dual : public Controller {
     int BackupMemory(Progress progress) override;
     int RestoreMemory(Progress progress) override;
     int GetData(ControllerData &data) override;
+    int GetState(ControllerData &data) override;
+    int WaitState(ControllerData &data, unsigned timeout) override;
+    int Calibrate(uint16_t deadzone) override;
+    int GetSticks(Sticks &sticks) override;
+    size_t GetButtonEvents(session::ButtonEvent *events, size_t count) override;
     int GetColor(ControllerColor &color) override;
     int SetColor(const ControllerColor &color) override;
     int SetLowPower(bool enable) override;
@@ -273,6 +347,8 @@ class JoyCon_Dual : public Controller {
     int SetRumble(bool enable) override;
     int Rumble(const rumble_data_t *left, const rumble_data_t *right) override;
     int Rumblef(const rumble_data_f_t *left, const rumble_data_f_t *right) override;
+    int Begin(unsigned window) override;
+    int Commit() override;
     int SetMcuState(McuState state);
     int SetMcuMode(McuMode mode);
     int CheckMcuMode(McuMode mode);
@@ -138,9 +138,15 @@ typedef struct DeviceDesc {
 #include <functional>
 using Sender = std::function<ssize_t(const void *, size_t)>;
 using Recver = std::function<ssize_t(void *, size_t)>;
+// fill up to `count` reports spaced by `stride` bytes and their sizes, returns the number of
+// reports received or a negative error
+using BatchRecver = std::function<ssize_t(void *, size_t stride, size_t count, size_t *sizes)>;
+using Waker = std::function<void(void)>;
 #else
 typedef ssize_t (*Recver)(const device_t *, void *, size_t);
 typedef ssize_t (*Sender)(const device_t *, const void *, size_t);
+typedef ssize_t (*BatchRecver)(const device_t *, void *, size_t, size_t, size_t *);
+typedef void (*Waker)(const device_t *);
 #endif
 
 typedef struct DeviceFunc {
@@ -148,6 +154,14 @@ typedef struct DeviceFunc {
     Recver recver;
     size_t send_size;
     size_t recv_size;
+    // optional, used instead of recver if set
+    BatchRecver batch_recver;
+    // optional fd readable when a report can be received without blocking, only used when
+    // pollable is set, so a zeroed DeviceFunc has none and fd 0 stays a valid one
+    int poll_fd;
+    bool pollable;
+    // optional, unblocks a recver waiting without poll_fd when the session stops
+    Waker waker;
 } device_func_t;
 
 typedef struct Device {
@@ -0,0 +1,71 @@
+/*
+ *   Copyright (c) 2020 mumumusuc
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef HIDAPI_CONTROLLER_H
+#define HIDAPI_CONTROLLER_H
+
+#include "controller.h"
+#include "session2.h"
+
+#ifdef __cplusplus
+#include <string>
+#include <vector>
+
+struct hid_device_;
+
+namespace hidapi {
+
+// An opened hidapi device. recver waits in hid_read_timeout() for at most RECV_TIMEOUT, there is
+// no fd to poll so the session keeps its own poll thread.
+class HidDevice {
+  private:
+    hid_device_ *handle_;
+    std::string path_;
+
+  public:
+    HidDevice(hid_device_ *handle, const char *path) : handle_(handle), path_(path){};
+    ~HidDevice();
+    HidDevice(const HidDevice &) = delete;
+    HidDevice &operator=(const HidDevice &) = delete;
+    const std::string &path() const { return path_; };
+    ssize_t Send(const void *, size_t);
+    ssize_t Recv(void *, size_t, int timeout);
+    // The HidDevice must outlive sessions built over it.
+    DeviceFunc Func();
+};
+
+// ControllerImpl opening its sessions through hidapi, OpenDevice(1, pid) takes the first device
+// with the Nintendo VID and pid not opened yet, OpenDevice(2, vid, pid) any VID.
+class HidapiImpl : public controller::ControllerImpl {
+  private:
+    std::vector<std::unique_ptr<HidDevice>> opened_;
+    session::Reactor *reactor_;
+
+  protected:
+    session::Session *OpenDevice(unsigned int, ...) override;
+
+  public:
+    explicit HidapiImpl(const Device *host, session::Reactor *reactor = nullptr);
+    ~HidapiImpl();
+    // impls alive, hid_exit() runs when the last one is deleted
+    static unsigned Users();
+};
+
+} // namespace hidapi
+
+#endif // __cplusplus
+#endif // HIDAPI_CONTROLLER_H
@@ -0,0 +1,82 @@
+/*
+ *   Copyright (c) 2020 mumumusuc
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef HIDRAW_H
+#define HIDRAW_H
+
+#include "controller.h"
+#include "session2.h"
+
+#ifdef __cplusplus
+#include <string>
+#include <vector>
+
+namespace hidraw {
+
+// a Nintendo controller found in sysfs
+struct DeviceInfo {
+    std::string path;   // device node, /dev/hidrawN
+    std::string serial; // HID_UNIQ, the controller's mac address
+    uint16_t vendor;
+    uint16_t product;
+};
+
+// Find the hidraw nodes of known controllers, VID 0x057e with the PID of JoyCon_L, JoyCon_R or
+// ProController, by reading HID_ID from <sysfs>/hidrawN/device/uevent.
+std::vector<DeviceInfo> Enumerate(const char *sysfs = "/sys/class/hidraw", const char *dev = "/dev");
+
+// A non-blocking hidraw fd, one report per read and write. Any fd keeping report boundaries
+// will do, a socketpair or a pty in raw mode stand in for tests.
+class Hidraw {
+  private:
+    int fd_;
+
+  public:
+    explicit Hidraw(int fd) : fd_(fd){};
+    ~Hidraw();
+    Hidraw(const Hidraw &) = delete;
+    Hidraw &operator=(const Hidraw &) = delete;
+    // returns nullptr and sets errno on failure
+    static Hidraw *Open(const char *path);
+    int fd() const { return fd_; };
+    ssize_t Send(const void *, size_t);
+    // returns 0 if no report is pending
+    ssize_t Recv(void *, size_t);
+    // DeviceFunc over the fd, with poll_fd for fd readiness. The Hidraw must outlive sessions
+    // built over it.
+    DeviceFunc Func();
+};
+
+// ControllerImpl opening its sessions over hidraw, OpenDevice(1, pid) takes the first device
+// found with that PID.
+class HidrawImpl : public controller::ControllerImpl {
+  private:
+    std::vector<DeviceInfo> devices_;
+    std::vector<std::unique_ptr<Hidraw>> opened_;
+    session::Reactor *reactor_;
+
+  protected:
+    session::Session *OpenDevice(unsigned int, ...) override;
+
+  public:
+    HidrawImpl(const Device *host, const std::vector<DeviceInfo> &devices, session::Reactor *reactor = nullptr);
+};
+
+} // namespace hidraw
+
+#endif // __cplusplus
+#endif // HIDRAW_H
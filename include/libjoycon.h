@@ -31,6 +31,8 @@ extern Controller *Controller_create(category_t);
 extern void Controller_destroy(Controller *);
 extern int Controller_pair(Controller *);
 extern int Controller_poll(Controller *, poll_type_t);
+extern int Controller_begin(Controller *, unsigned);
+extern int Controller_commit(Controller *);
 extern int Controller_set_low_power(Controller *, int);
 extern int Controller_set_player(Controller *, uint8_t, uint8_t);
 extern int Controller_set_rumble(Controller *, int);
@@ -0,0 +1,96 @@
+/*
+ *   Copyright (c) 2020 mumumusuc
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MANAGER_H
+#define MANAGER_H
+
+#include "controller.h"
+#include "session2.h"
+
+#ifdef __cplusplus
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace controller {
+
+// latency of one device over all commands run, in us
+struct DeviceStats {
+    uint64_t commands;
+    uint64_t errors;
+    session::Histogram latency;
+};
+
+// one command run across all devices
+struct RunStats {
+    size_t commands;
+    size_t errors;
+    uint64_t elapsed;  // us, first start to last end
+    double throughput; // commands per second
+    uint64_t p50;      // us, over the devices
+    uint64_t p99;
+    uint64_t max;
+};
+
+// upper bound of the histogram bucket holding the pct percentile, in us
+uint64_t Percentile(const session::Histogram &histogram, unsigned pct);
+
+// Owns many controllers, whose sessions share one reactor, and runs commands across all of
+// them on one worker pool. Controllers keep their blocking API, a worker runs one command
+// at a time.
+class ControllerManager {
+  public:
+    using Command = std::function<int(Controller &)>;
+
+  private:
+    struct Entry {
+        std::unique_ptr<Controller> controller;
+        session::AtomicHistogram latency;
+        std::atomic<uint64_t> commands;
+        std::atomic<uint64_t> errors;
+        explicit Entry(Controller *c) : controller(c), commands(0), errors(0){};
+    };
+    session::Reactor reactor_;
+    ThreadPool pool_;
+    std::mutex lock_;
+    std::vector<std::unique_ptr<Entry>> entries_;
+
+  public:
+    explicit ControllerManager(unsigned io_threads = 1, unsigned workers = 8);
+    ~ControllerManager();
+    ControllerManager(const ControllerManager &) = delete;
+    ControllerManager &operator=(const ControllerManager &) = delete;
+    // for impls opening their sessions on the shared reactor, like hidraw::HidrawImpl
+    session::Reactor *reactor() { return &reactor_; };
+    // takes the controller, returns its index
+    size_t Add(Controller *controller);
+    // builds a controller of category over host, its sessions on the shared reactor
+    Controller *Add(Category category, const Device &host);
+    size_t Size();
+    Controller *Get(size_t index);
+    void GetStats(size_t index, DeviceStats &stats);
+    // runs command on every controller in parallel and waits for all of them
+    RunStats Run(const Command &command);
+    RunStats SetPlayer(Player player, PlayerFlash flash);
+    RunStats SetImu(bool enable);
+    RunStats BackupMemory();
+};
+
+} // namespace controller
+
+#endif // __cplusplus
+#endif // MANAGER_H
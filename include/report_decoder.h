@@ -0,0 +1,92 @@
+/*
+ *   Copyright (c) 2020 mumumusuc
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef REPORT_DECODER_H
+#define REPORT_DECODER_H
+
+#include "stick.h"
+
+#ifdef __cplusplus
+#include <stddef.h>
+#include <stdint.h>
+
+namespace controller {
+
+// report bytes read by the decoder, up to the end of the imu samples
+static const size_t DECODE_REPORT_SIZE = 49;
+// imu values of a report, 3 samples of x y z
+static const size_t DECODE_IMU_VALUES = 9;
+// G and degree/s per unit at ACC_SENS_DEFAULT and GYRO_SENS_DEFAULT
+static const float ACC_SCALE_DEFAULT = 8.0f / 32768;
+static const float GYRO_SCALE_DEFAULT = 2000.0f / 32768;
+
+// Structure of arrays written by ReportDecoder::Decode(), arrays left null are skipped.
+// IMU values are only meaningful for reports streamed with the imu on.
+struct ReportBatch {
+    uint32_t *buttons; // the 3 bytes of button_t, first byte lowest
+    float *left_x;     // sticks calibrated to [-1, 1]
+    float *left_y;
+    float *right_x;
+    float *right_y;
+    float *acc;  // DECODE_IMU_VALUES per report, G
+    float *gyro; // DECODE_IMU_VALUES per report, degree/s
+};
+
+// Batch decoder of raw input reports for offline analysis, with SSE2 and AVX2 kernels on x86
+// picked at construction and a scalar one everywhere.
+class ReportDecoder {
+  public:
+    enum Kernel {
+        SCALAR,
+        SSE2,
+        AVX2,
+    };
+
+  private:
+    // stick axis, scales are 1 / (reach - deadzone)
+    struct Axis {
+        float center;
+        float deadzone;
+        float above;
+        float below;
+    };
+    // left x, left y, right x, right y
+    Axis axes_[4];
+    // scale of each imu value in report order, acc and gyro triplets alternate, padded to
+    // whole vectors
+    static const int IMU_SCALES = 24;
+    float imu_scale_[IMU_SCALES];
+    Kernel kernel_;
+    void DecodeScalar(const uint8_t *, size_t, size_t, size_t, const ReportBatch &) const;
+    void DecodeSse2(const uint8_t *, size_t, size_t, const ReportBatch &) const;
+    void DecodeAvx2(const uint8_t *, size_t, size_t, const ReportBatch &) const;
+
+  public:
+    ReportDecoder();
+    void Load(bool right, const StickCalibration &calibration, uint16_t deadzone = STICK_DEADZONE_DEFAULT);
+    void SetImuScale(float acc, float gyro);
+    Kernel kernel() const { return kernel_; };
+    // for tests and benchmarks, returns false if the cpu lacks the kernel
+    bool SetKernel(Kernel kernel);
+    // decode count reports placed stride bytes apart, stride at least DECODE_REPORT_SIZE
+    void Decode(const void *reports, size_t stride, size_t count, const ReportBatch &batch) const;
+};
+
+} // namespace controller
+
+#endif // __cplusplus
+#endif // REPORT_DECODER_H
@@ -19,8 +19,8 @@
 #define SESSION_H
 
 #include "device.h"
+#include "input_report.h"
 #include <pthread.h>
-#include <semaphore.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
@@ -37,9 +37,11 @@
 
 namespace session {
 class Task;
-using Inspector = std::function<int(const void *)>;
-using Deleter = std::function<void(Task *)>;
-using TaskSp = std::unique_ptr<Task, Deleter>;
+class TaskPool;
+class Session;
+class Reactor;
+// inspectors are stored in place, captures must fit in InplaceFunction
+using Inspector = InplaceFunction<int(const void *)>;
 
 enum Result {
     DONE = 0,
@@ -48,82 +50,543 @@ enum Result {
     TIMEDOUT = ETIMEDOUT,
     ABORT = ECANCELED,
     ERROR,
+    LOST = ENOLINK, // failed fast while the link is lost
 };
 
+// health of the link to the device, judged by the errors of its recver and sender
+enum LinkState {
+    LINK_HEALTHY,
+    LINK_DEGRADED,   // errors pile up, reports still get through
+    LINK_LOST,       // errors only, the I/O threads back off and tasks fail with LOST
+    LINK_RECOVERING, // reports again after LINK_LOST
+};
+// called on the thread seeing the change, mostly an I/O thread of the session, it must not
+// wait for a task of the session. On a Reactor it runs in the loop serving other sessions too,
+// so it must not block.
+using LinkCallback = std::function<void(LinkState from, LinkState to)>;
+
+// Every error adds one to the error score and every report takes one off, so a link losing
+// fewer reports than it passes stays healthy.
+static const int LINK_DEGRADED_ERRORS = 4;
+static const int LINK_LOST_ERRORS = 16;
+// reports in a row taking LINK_RECOVERING back to LINK_HEALTHY
+static const int LINK_RECOVER_REPORTS = 8;
+// backoff of the I/O threads after each error while the link is lost, doubled up to max
+static const int LINK_BACKOFF_MIN_MS = 1;
+static const int LINK_BACKOFF_MAX_MS = 256;
+
 enum PushType {
-    FREE,
-    TIMED,
+    FREE,  // Transmit sends from the caller thread
+    TIMED, // push thread sends one report every period
+    QUEUED, // Transmit queues the report, the push thread sends it as soon as it can
+};
+
+// TIMED push periods in ms, the rates the controllers are known to keep up with
+static const unsigned PUSH_PERIOD_15MS = 15;
+static const unsigned PUSH_PERIOD_8MS = 8;
+static const unsigned PUSH_PERIOD_5MS = 5;
+// reports waiting for TIMED push, must be power of 2
+static const unsigned PUSH_QUEUE_SLOTS = 8;
+// reports waiting for QUEUED push, must be power of 2
+static const unsigned SEND_QUEUE_SLOTS = 32;
+// largest DeviceFunc::send_size, a FREE push sends a copy of the report from the stack
+static const size_t SEND_SIZE_MAX = 64;
+
+// statistics of TIMED and QUEUED push, times in ns and only kept by TIMED push
+struct PushStats {
+    uint64_t reports;   // reports sent
+    uint64_t subcmds;   // queued reports sent
+    uint64_t dropped;   // reports refused by a full queue
+    uint64_t depth;     // reports waiting in the queue
+    uint64_t depth_max; // most reports ever waiting
+    uint64_t missed;    // periods skipped after an overrun
+    uint64_t period_min;
+    uint64_t period_max;
+    uint64_t period_avg;
+    uint64_t late_avg; // wake up behind the deadline
+    uint64_t late_max;
 };
 
+// wildcard of Route fields
+static const uint8_t ROUTE_ANY = 0xff;
+// slots of route table, must be power of 2 and fit in route mask.
+// Route::Slot() maps the known report ids and subcmd replies to distinct slots.
+static const unsigned ROUTE_SLOTS = 32;
+
+// routing key of a task, only reports matching the key are passed to its inspector
+struct Route {
+    uint8_t id;     // input report id
+    uint8_t subcmd; // subcmd id of 0x21 reply
+    Route() : id(ROUTE_ANY), subcmd(ROUTE_ANY){};
+    explicit Route(uint8_t id) : id(id), subcmd(ROUTE_ANY){};
+    Route(uint8_t id, uint8_t subcmd) : id(id), subcmd(subcmd){};
+    unsigned Slot() const { return ((id << 8 | subcmd) * 0x9e8bu >> 10) & (ROUTE_SLOTS - 1); };
+    bool Match(uint8_t id, uint8_t subcmd) const {
+        return (this->id == ROUTE_ANY || this->id == id) && (this->subcmd == ROUTE_ANY || this->subcmd == subcmd);
+    };
+};
+
+// buckets of latency histograms, bucket 0 counts samples under 1 us, bucket n samples in
+// [2^(n-1), 2^n) us and the last one everything above
+static const unsigned HISTOGRAM_BUCKETS = 20;
+// subcmd ids with a RTT histogram
+static const unsigned STATS_SUBCMDS = 0x80;
+
+struct Histogram {
+    uint64_t count;
+    uint64_t sum; // us
+    uint64_t max; // us
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+// snapshot of Session counters, each one is read atomically but not all at once
+struct SessionStats {
+    uint64_t sent;
+    uint64_t send_errors;
+    uint64_t received;
+    uint64_t recv_errors;
+    uint64_t done;     // tasks completed by their inspector or without one
+    uint64_t timeouts; // tasks timed out
+    uint64_t aborts;   // tasks aborted, or refused by a full push queue
+    uint64_t errors;   // tasks failed by send error or inspector
+    uint64_t lost;       // input reports missing from the timer sequence
+    uint64_t duplicates; // input reports repeating the previous timer
+    uint64_t reports[256];        // received reports by id
+    Histogram rtt[STATS_SUBCMDS]; // Transmit to reply of 0x21 tasks, by subcmd id
+};
+
+class AtomicHistogram {
+  private:
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+    std::atomic<uint64_t> buckets_[HISTOGRAM_BUCKETS];
+
+  public:
+    AtomicHistogram() : count_(0), sum_(0), max_(0), buckets_(){};
+    void Record(uint64_t us) {
+        unsigned bucket = us ? 64 - __builtin_clzll(us) : 0;
+        if (bucket >= HISTOGRAM_BUCKETS)
+            bucket = HISTOGRAM_BUCKETS - 1;
+        buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(us, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        while (us > max && !max_.compare_exchange_weak(max, us, std::memory_order_relaxed))
+            ;
+    };
+    void Load(Histogram &h) const {
+        h.count = count_.load(std::memory_order_relaxed);
+        h.sum = sum_.load(std::memory_order_relaxed);
+        h.max = max_.load(std::memory_order_relaxed);
+        for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i)
+            h.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    };
+};
+
+struct TaskLink {
+    Task *prev;
+    Task *next;
+};
+
+// A pooled task completes exactly once; the first Result wins. It is shared by the
+// session (while queued) and the Future (until Get() returns), the last one releases it
+// back to its pool.
 class Task {
   private:
-    int retry_;
-    std::promise<Result> promise_;
+    template <TaskLink Task::*>
+    friend class TaskList;
+    friend class TaskPool;
+    friend class Session;
+    uint64_t timeout_;
+    uint64_t start_;
+    std::atomic<uint64_t> deadline_;
+    Route route_;
     Inspector inspector_;
+    std::atomic<int> state_;
+    std::atomic<int> waiters_;
+    std::atomic<int> refs_;
+    TaskPool *pool_;
+    TaskLink route_link_; // route table, or free list of pool
+    TaskLink wheel_link_; // timer wheel
+    unsigned wheel_slot_;
+    void Complete(Result);
 
   public:
-    explicit Task();
-    std::future<Result> Reset(unsigned int, const Inspector &);
+    explicit Task(TaskPool *);
+    void Reset(unsigned int, const Route &, const Inspector &);
+    void Arm(uint64_t);
     void Done();
     void Abort();
     void Error();
-    bool Test(const void *);
+    void Timeout();
+    bool Test(const void *, uint64_t);
+    bool Expired(uint64_t now) const { return now >= deadline(); };
+    uint64_t start() const { return start_; };
+    uint64_t deadline() const { return deadline_.load(std::memory_order_relaxed); };
+    const Route &route() const { return route_; };
+    Result Wait();
+    void Release();
 };
 
-class TaskPool {
+// intrusive list of tasks, linked through one of the TaskLink members of Task
+template <TaskLink Task::*L>
+class TaskList {
   private:
-    int exported_;
-    std::mutex lock_;
-    std::queue<Task *> pool_;
+    Task *head_;
+    Task *tail_;
 
   public:
-    explicit TaskPool();
-    ~TaskPool();
-    TaskSp Get();
+    TaskList() : head_(nullptr), tail_(nullptr){};
+    bool Empty() const { return head_ == nullptr; };
+    Task *Front() const { return head_; };
+    static Task *Next(const Task *task) { return (task->*L).next; };
+    void PushBack(Task *task) {
+        (task->*L).prev = tail_;
+        (task->*L).next = nullptr;
+        if (tail_)
+            (tail_->*L).next = task;
+        else
+            head_ = task;
+        tail_ = task;
+    };
+    void Erase(Task *task) {
+        if ((task->*L).prev)
+            ((task->*L).prev->*L).next = (task->*L).next;
+        else
+            head_ = (task->*L).next;
+        if ((task->*L).next)
+            ((task->*L).next->*L).prev = (task->*L).prev;
+        else
+            tail_ = (task->*L).prev;
+        (task->*L).prev = (task->*L).next = nullptr;
+    };
+};
+// result of Session::Transmit, like std::future<Result> without shared state allocation
+class Future {
+  private:
+    Task *task_;
+
+  public:
+    Future() : task_(nullptr){};
+    explicit Future(Task *task) : task_(task){};
+    Future(Future &&other) : task_(other.task_) { other.task_ = nullptr; };
+    Future &operator=(Future &&other);
+    Future(const Future &) = delete;
+    Future &operator=(const Future &) = delete;
+    ~Future();
+    bool Valid() const { return task_ != nullptr; };
+    // wait for the result and release the task, Future becomes invalid
+    Result Get();
+};
+
+// timer wheel of task deadlines, slots must be power of 2
+static const unsigned WHEEL_SLOTS = 128;
+static const uint64_t WHEEL_TICK = 2000000; // ns
+
+// slots of inbound report ring, must be power of 2
+static const unsigned RING_SLOTS = 32;
+// most reports taken from DeviceFunc::batch_recver at once
+static const unsigned RECV_BATCH = 8;
+// size of the 0x31 reports carrying NFC/IR MCU data, received while subcmd 0x03 set that mode
+static const size_t RECV_LARGE_SIZE = 362;
+
+// Fixed-capacity ring of input reports with a single producer (the poll thread).
+// Each slot is guarded by its own sequence counter: odd while the producer writes it,
+// even once published. Readers copy a slot by sequence number without locks and
+// detect being lapped by the producer.
+class ReportRing {
+  private:
+    struct Slot {
+        std::atomic<uint64_t> seq;
+        uint64_t time;
+        size_t size;
+    };
+    const size_t stride_;
+    std::atomic<uint64_t> head_;
+    Slot *slots_;
+    uint8_t *data_;
+
+  public:
+    explicit ReportRing(size_t);
+    ~ReportRing();
+    ReportRing(const ReportRing &) = delete;
+    ReportRing &operator=(const ReportRing &) = delete;
+    void *Acquire();
+    void *Acquire(size_t &);
+    uint64_t Publish(size_t, uint64_t);
+    uint64_t Head() const { return head_.load(std::memory_order_acquire); };
+    ssize_t Read(uint64_t, void *, size_t, uint64_t *) const;
 };
 
-class Semaphore {
+// Bounded queue of output reports with a single producer and a single consumer. Slots are
+// filled in place, Reserve() returns nullptr when the queue is full.
+class SendQueue {
   private:
-    sem_t sem_;
+    const size_t stride_;
+    std::atomic<unsigned> head_;
+    std::atomic<unsigned> tail_;
+    uint8_t *data_;
 
   public:
-    explicit Semaphore(unsigned);
-    ~Semaphore();
-    void Wait();
-    bool TryWait();
-    void Post();
-    bool Valid();
+    explicit SendQueue(size_t);
+    ~SendQueue();
+    SendQueue(const SendQueue &) = delete;
+    SendQueue &operator=(const SendQueue &) = delete;
+    void *Reserve();
+    void Commit();
+    void *Front();
+    void Pop();
+    unsigned Depth() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    };
+};
+
+// period of the input timer byte, which wraps every 256 ticks
+static const uint64_t TIMER_TICK_NS = 5000000;
+// how far timestamps may catch up with receive times per report, bounds the clock drift followed
+static const uint64_t TIMER_DRIFT_NS = 10000;
+
+// controller state of the latest 0x21, 0x30 or 0x31 report
+struct InputState {
+    uint64_t seq;       // reports decoded so far, 0 before the first one
+    uint64_t time;      // receive time, CLOCK_MONOTONIC ns
+    uint64_t ticks;     // input timer unwrapped, 0 at the first report
+    uint64_t timestamp; // report time from ticks, CLOCK_MONOTONIC ns, never after the receive time
+    controller_state_t controller_state;
+    controller_data_t controller_data;
+};
+
+// button edges of one report, masks of the 3 bytes of button_t, first byte lowest
+struct ButtonEvent {
+    uint64_t time; // timestamp of the report, see InputState
+    uint32_t pressed;
+    uint32_t released;
+};
+// button events kept until read, must be power of 2
+static const unsigned BUTTON_EVENT_SLOTS = 64;
+
+// tasks allocated along with a pool
+static const unsigned TASK_POOL_RESERVE = 8;
+
+class TaskPool {
+  private:
+    int exported_;
+    bool orphaned_;
+    std::mutex lock_;
+    Task *free_;
+    ~TaskPool();
+
+  public:
+    explicit TaskPool();
+    Task *Get();
+    void Put(Task *);
+    void Orphan();
 };
 
 class Session {
   private:
-    bool is_alive_;
-    int err_count_;
+    std::atomic<bool> is_alive_;
+    // link health, err_count_ is the error score, changed under link_lock_
+    std::mutex link_lock_;
+    std::atomic<int> link_state_;
+    std::atomic<int> err_count_;
+    int link_good_;
+    int link_backoff_;
+    // monotonic ns a session on a reactor backs off until, 0 when it does not. Loop thread only.
+    uint64_t resume_;
+    LinkCallback link_callback_;
     DeviceFunc remote_;
-    void *recv_buffer_;
+    std::unique_ptr<ReportRing> ring_;
+    // Reports are received straight into ring slots of DeviceFunc::recv_size. In the large
+    // report mode they are received whole into large_buffer_, dispatched from there, and only
+    // their first recv_size bytes go to the ring.
+    std::atomic<size_t> recv_size_;
+    void *large_buffer_;
     void *send_buffer_;
-    std::list<TaskSp> task_queue_;
+    using RouteList = TaskList<&Task::route_link_>;
+    using WheelList = TaskList<&Task::wheel_link_>;
+    // tasks are indexed by Route::Slot(), bit n of route_mask_ is set when slot n is not empty
+    RouteList task_table_[ROUTE_SLOTS];
+    std::atomic<uint32_t> route_mask_;
+    // hashed timer wheel of task deadlines, wheel_tick_ is the last tick swept
+    WheelList wheel_[WHEEL_SLOTS];
+    std::atomic<uint64_t> wheel_tick_;
+    std::atomic<int> armed_;
     std::mutex task_lock_;
-    TaskPool task_pool_;
+    TaskPool *task_pool_;
     pthread_t tr_poll_;
     pthread_t tr_push_;
     bool poll_running_;
     bool push_running_;
     PushType push_type_;
-    Semaphore push_sem_;
+    uint64_t push_period_;
+    // queued reports and latest rumble of TIMED push
+    std::mutex push_lock_;
+    uint8_t *push_queue_;
+    unsigned push_head_;
+    unsigned push_tail_;
+    uint8_t rumble_[8];
+    PushStats push_stats_;
+    uint64_t push_period_sum_;
+    uint64_t push_late_sum_;
+    // reports of QUEUED push, callers are serialized by push_lock_ to keep a single producer
+    std::unique_ptr<SendQueue> send_queue_;
+    // timerfd of TIMED push and the deadline it last fired for, eventfd of QUEUED push
+    int push_timer_;
+    uint64_t push_deadline_;
+    uint64_t push_last_;
+    // eventfd written once to stop the session threads
+    int stop_fd_;
+    // eventfd waking the poll thread when tasks become pending
+    int wake_fd_;
+    // Latest controller state, a seqlock with a single writer (the poll thread), state_lock_
+    // is odd while state_ is written. state_wake_ is the futex word of WaitState(), bumped by
+    // the writer for its waiters and by Stop().
+    std::atomic<int> state_lock_;
+    std::atomic<int> state_wake_;
+    std::atomic<int> state_waiters_;
+    InputState state_;
+    // input timer unwrapping: the last timer byte, its receive time, the smallest advance seen
+    // between two reports, and the offset of tick 0 on CLOCK_MONOTONIC. Poll thread only.
+    uint8_t timer_last_;
+    uint64_t timer_recv_;
+    uint64_t timer_step_;
+    int64_t timer_offset_;
+    // timer byte of output reports
+    std::atomic<uint8_t> send_timer_;
+    // button edges, a ring with the poll thread as producer and one reader, full ring drops
+    // new events
+    uint32_t buttons_;
+    ButtonEvent button_events_[BUTTON_EVENT_SLOTS];
+    std::atomic<uint64_t> button_head_;
+    std::atomic<uint64_t> button_tail_;
+    std::atomic<uint64_t> button_dropped_;
+    // reactor serving the session instead of its poll and push threads
+    friend class Reactor;
+    Reactor *reactor_;
+    uint64_t reactor_id_;
+    // counters behind GetStats(), updated lock free
+    struct Counters {
+        std::atomic<uint64_t> sent;
+        std::atomic<uint64_t> send_errors;
+        std::atomic<uint64_t> received;
+        std::atomic<uint64_t> recv_errors;
+        std::atomic<uint64_t> done;
+        std::atomic<uint64_t> timeouts;
+        std::atomic<uint64_t> aborts;
+        std::atomic<uint64_t> errors;
+        std::atomic<uint64_t> lost;
+        std::atomic<uint64_t> duplicates;
+        std::atomic<uint64_t> reports[256];
+        AtomicHistogram rtt[STATS_SUBCMDS];
+        Counters()
+            : sent(0), send_errors(0), received(0), recv_errors(0), done(0), timeouts(0), aborts(0), errors(0), lost(0),
+              duplicates(0), reports(){};
+    } counters_;
     void *Poll();
     void *Push();
-    void Append(TaskSp &&);
-    ssize_t Send(const void *);
-    ssize_t Recv(void *);
+    void PollOnce();
+    void Deliver(void *, size_t, uint64_t);
+    void Decode(const uint8_t *, size_t, uint64_t);
+    void Stamp(uint8_t, uint64_t);
+    void SetMode(uint8_t);
+    int StartPush();
+    void PushOnce();
+    void Drain();
+    void Stop();
+    void Doze(int);
+    void Backoff(int);
+    int Link(bool);
+    void Fail(Result);
+    bool Append(Task *);
+    void Remove(Task *);
+    void Schedule(Task *);
+    void PollBatch();
+    void Dispatch(const void *, size_t, uint64_t);
+    void Expire(uint64_t);
+    int Enqueue(const void *);
+    void Account(uint64_t, uint64_t, uint64_t, uint64_t, bool);
+    void Count(int);
+    ssize_t Send(void *);
+    ssize_t SendCopy(const void *);
+    ssize_t Recv(void *, size_t);
 
   public:
-    explicit Session(const DeviceFunc *);
+    // period in ms, only used by TIMED push
+    explicit Session(const DeviceFunc *, PushType = FREE, unsigned period = PUSH_PERIOD_15MS);
+    // Served by reactor, which must outlive the session. The device needs a poll_fd, without
+    // one the session still runs its own threads.
+    Session(const DeviceFunc *, Reactor *reactor, PushType = FREE, unsigned period = PUSH_PERIOD_15MS);
     ~Session();
-    std::future<Result> Transmit(unsigned int, const void *, const Inspector &);
+    // timeout in ms, the task times out at a monotonic deadline whether reports arrive or not.
+    // With TIMED or QUEUED push the report is queued and sent by the push thread, the task ends
+    // with AGAIN if the queue is full. A task without inspector is DONE once queued.
+    Future Transmit(unsigned int, const void *, const Route &, const Inspector &);
+    // sequence number the next received report will be published with
+    uint64_t Head() const;
+    // copy report `seq` and its receive time (CLOCK_MONOTONIC, ns), returns the copied size,
+    // -EAGAIN if it is not received yet, -EOVERFLOW if it was overwritten
+    ssize_t Read(uint64_t seq, void *buffer, size_t size, uint64_t *time = nullptr) const;
+    // Push a report the host received, for devices delivering reports by callback instead of a
+    // recver. It is dispatched on the caller thread, one thread at a time, and no poll thread
+    // runs. Returns the size taken, -EINVAL if the session has a recver.
+    ssize_t Feed(const void *report, size_t size);
+    // Copy the latest controller state without locks, returns false before the first report
+    // carrying one.
+    bool GetState(InputState &state) const;
+    // Wait up to timeout ms for a state newer than seq, returns DONE, TIMEDOUT, or ABORT if
+    // the session stops. Waiters sleep on a futex, no task is queued.
+    Result WaitState(InputState &state, uint64_t seq, unsigned timeout);
+    // Move up to count button events, oldest first, to events. One reader at a time.
+    size_t ReadButtonEvents(ButtonEvent *events, size_t count);
+    // button events dropped by a full ring
+    uint64_t ButtonEventsDropped() const { return button_dropped_.load(std::memory_order_relaxed); };
+    PushStats GetPushStats();
+    LinkState GetLinkState() const { return static_cast<LinkState>(link_state_.load(std::memory_order_relaxed)); };
+    void SetLinkCallback(const LinkCallback &callback);
+    void GetStats(SessionStats &) const;
+};
+
+// A fixed pool of epoll loops serving many sessions, in place of a poll thread and a push
+// thread for each of them. Each session is bound to one loop, so it is still driven by a
+// single thread.
+class Reactor {
+  private:
+    friend class Session;
+    struct Entry {
+        uint64_t id;
+        Session *session;
+        bool paused; // its poll_fd and push_timer_ are out of the epoll set while it backs off
+    };
+    struct Loop {
+        Reactor *reactor;
+        int epoll_fd;
+        pthread_t thread;
+        bool running;
+        std::mutex lock;
+        std::vector<Entry> sessions;
+        Loop() : reactor(nullptr), epoll_fd(-1), running(false){};
+    };
+    int stop_fd_;
+    std::atomic<uint64_t> next_id_;
+    std::vector<Loop> loops_;
+    void Add(Session *);
+    void Remove(Session *);
+    void Run(Loop &);
+    void Pause(Loop &, Entry &, bool);
+    void Stop();
+
+  public:
+    explicit Reactor(unsigned threads = 1);
+    ~Reactor();
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+    // sessions served
+    size_t Size();
 };
 
 }; // namespace session
 
 #endif // __cplusplus
-#endif // SESSION_H
\ No newline at end of file
+#endif // SESSION_H
@@ -0,0 +1,75 @@
+/*
+ *   Copyright (c) 2020 mumumusuc
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STICK_H
+#define STICK_H
+
+#include "controller_defs.h"
+
+#ifdef __cplusplus
+#include <stdint.h>
+
+namespace controller {
+
+// raw 12 bit stick values
+static const unsigned STICK_RAW_RANGE = 4096;
+// normalized stick values are in [-STICK_MAX, STICK_MAX]
+static const int16_t STICK_MAX = 32767;
+// raw distance from center read as 0, about the factory deadzone
+static const uint16_t STICK_DEADZONE_DEFAULT = 0xae;
+
+// factory calibration of one stick, raw values of x and y
+struct StickCalibration {
+    uint16_t center[2];
+    uint16_t above[2]; // reach above center
+    uint16_t below[2]; // reach below center
+    // Parse a FLASH_ADDR_STICK_CALIB_LEN block, the left and right sticks order their values
+    // differently. Returns false and takes a nominal calibration if the block is blank.
+    bool Parse(const uint8_t *block, bool right);
+};
+
+struct Sticks {
+    int16_t left_x;
+    int16_t left_y;
+    int16_t right_x;
+    int16_t right_y;
+};
+
+static inline float stick_float(int16_t value) { return value / static_cast<float>(STICK_MAX); }
+
+// Maps raw stick values to normalized ones with a table for each axis, built once from the
+// calibration. Sticks not loaded use a nominal calibration.
+class StickDecoder {
+  private:
+    // left x, left y, right x, right y
+    int16_t lut_[4][STICK_RAW_RANGE];
+
+  public:
+    StickDecoder();
+    void Load(bool right, const StickCalibration &calibration, uint16_t deadzone = STICK_DEADZONE_DEFAULT);
+    void Decode(const ControllerData &data, Sticks &sticks) const {
+        sticks.left_x = lut_[0][data.left_stick.X];
+        sticks.left_y = lut_[1][data.left_stick.Y];
+        sticks.right_x = lut_[2][data.right_stick.X];
+        sticks.right_y = lut_[3][data.right_stick.Y];
+    };
+};
+
+} // namespace controller
+
+#endif // __cplusplus
+#endif // STICK_H
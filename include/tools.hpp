@@ -20,24 +20,140 @@
 
 #include <assert.h>
 #include <atomic>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <condition_variable>
+#include <cstddef>
 #include <functional>
 #include <future>
 #include <list>
 #include <memory>
 #include <mutex>
+#include <new>
 #include <queue>
 #include <stdexcept>
 #include <thread>
+#include <time.h>
+#include <type_traits>
 #include <vector>
 
 typedef std::unique_lock<std::mutex> UNIQUE_LOCK;
 typedef std::lock_guard<std::mutex> GUARD_LOCK;
 #define THIS_THREAD std::this_thread::get_id()
+
+static inline uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
 #define creater_t std::function<T *()>
 #define deleter_t std::function<void(T *)>
 #define recycler_t std::function<void(T *)>
 
+// futex on a std::atomic<int>, timeout is relative
+static inline int futex_wait(std::atomic<int> *addr, int expected, const struct timespec *timeout) {
+    return syscall(SYS_futex, reinterpret_cast<int *>(addr), FUTEX_WAIT_PRIVATE, expected, timeout, nullptr, 0);
+}
+
+static inline int futex_wake(std::atomic<int> *addr, int count) {
+    return syscall(SYS_futex, reinterpret_cast<int *>(addr), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+
+// std::function without heap, the callable is stored in place and must fit in Size bytes
+template <typename T, size_t Size = 12 * sizeof(void *)>
+class InplaceFunction;
+
+template <typename R, typename... Args, size_t Size>
+class InplaceFunction<R(Args...), Size> {
+  private:
+    enum Op {
+        COPY,
+        MOVE,
+        DESTROY,
+    };
+    using Invoker = R (*)(void *, Args...);
+    using Manager = void (*)(Op, void *, void *);
+    typename std::aligned_storage<Size, alignof(std::max_align_t)>::type storage_;
+    Invoker invoker_;
+    Manager manager_;
+
+    template <typename F>
+    static R Invoke(void *f, Args... args) { return (*reinterpret_cast<F *>(f))(std::forward<Args>(args)...); }
+
+    template <typename F>
+    static void Manage(Op op, void *dst, void *src) {
+        switch (op) {
+        case COPY:
+            new (dst) F(*reinterpret_cast<const F *>(src));
+            break;
+        case MOVE:
+            new (dst) F(std::move(*reinterpret_cast<F *>(src)));
+            break;
+        case DESTROY:
+            reinterpret_cast<F *>(dst)->~F();
+            break;
+        }
+    }
+
+    void Reset() {
+        if (manager_)
+            manager_(DESTROY, &storage_, nullptr);
+        invoker_ = nullptr;
+        manager_ = nullptr;
+    }
+
+  public:
+    InplaceFunction() noexcept : invoker_(nullptr), manager_(nullptr){};
+    InplaceFunction(std::nullptr_t) noexcept : invoker_(nullptr), manager_(nullptr){};
+    template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InplaceFunction>::value>::type>
+    InplaceFunction(F &&f) : invoker_(nullptr), manager_(nullptr) {
+        using T = typename std::decay<F>::type;
+        static_assert(sizeof(T) <= Size, "callable is too large for InplaceFunction");
+        static_assert(alignof(T) <= alignof(std::max_align_t), "callable is over aligned");
+        new (&storage_) T(std::forward<F>(f));
+        invoker_ = &Invoke<T>;
+        manager_ = &Manage<T>;
+    }
+    InplaceFunction(const InplaceFunction &other) : invoker_(other.invoker_), manager_(other.manager_) {
+        if (manager_)
+            manager_(COPY, &storage_, const_cast<void *>(reinterpret_cast<const void *>(&other.storage_)));
+    }
+    InplaceFunction(InplaceFunction &&other) : invoker_(other.invoker_), manager_(other.manager_) {
+        if (manager_)
+            manager_(MOVE, &storage_, &other.storage_);
+    }
+    ~InplaceFunction() { Reset(); }
+    InplaceFunction &operator=(const InplaceFunction &other) {
+        if (this != &other) {
+            Reset();
+            if (other.manager_)
+                other.manager_(COPY, &storage_, const_cast<void *>(reinterpret_cast<const void *>(&other.storage_)));
+            invoker_ = other.invoker_;
+            manager_ = other.manager_;
+        }
+        return *this;
+    }
+    InplaceFunction &operator=(InplaceFunction &&other) {
+        if (this != &other) {
+            Reset();
+            if (other.manager_)
+                other.manager_(MOVE, &storage_, &other.storage_);
+            invoker_ = other.invoker_;
+            manager_ = other.manager_;
+        }
+        return *this;
+    }
+    InplaceFunction &operator=(std::nullptr_t) {
+        Reset();
+        return *this;
+    }
+    explicit operator bool() const { return invoker_ != nullptr; }
+    R operator()(Args... args) const {
+        return invoker_(const_cast<void *>(reinterpret_cast<const void *>(&storage_)), std::forward<Args>(args)...);
+    }
+};
+
 template <typename T>
 class ObjectPool {
 #define OBJ_POOL_DEBUG 0
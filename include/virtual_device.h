@@ -0,0 +1,111 @@
+/*
+ *   Copyright (c) 2020 mumumusuc
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIRTUAL_DEVICE_H
+#define VIRTUAL_DEVICE_H
+
+#include "controller_defs.h"
+#include "input_report.h"
+#include "mcu.h"
+#include "output_report.h"
+
+#ifdef __cplusplus
+#include <atomic>
+#include <mutex>
+#include <pthread.h>
+#include <vector>
+
+namespace virtual_device {
+
+#define VIRTUAL_PERIOD_DEFAULT 15000 // us, the report rate of a bluetooth controller
+#define VIRTUAL_FIRMWARE 0x0348
+#define IR_FRAGMENT_SIZE 300
+
+struct VirtualStats {
+    uint64_t subcmds;   // 0x01 output reports handled
+    uint64_t mcu;       // 0x11 output reports handled
+    uint64_t rumbles;   // 0x10 output reports
+    uint64_t streamed;  // input reports sent by the stream timer
+    uint64_t fragments; // ir fragments sent, resends included
+};
+
+// An in-process Joy-Con or Pro Controller. Output reports given to the sender are decoded
+// like the firmware does: subcmd replies, a 512 KB spi flash, the MCU and the IR camera
+// fragment protocol. A timer thread streams 0x30 reports with synthetic IMU samples, or 0x31
+// reports carrying IR fragments, once per period. Reports are read from a SOCK_SEQPACKET
+// socketpair, so the DeviceFunc has a poll_fd and works on a Reactor too.
+class VirtualController {
+  private:
+    const Category category_;
+    const unsigned period_;
+    int fds_[2];
+    int stop_fd_;
+    int timer_fd_;
+    pthread_t thread_;
+    bool running_;
+    mutable std::mutex lock_;
+    std::vector<uint8_t> flash_;
+    ControllerData data_;
+    uint8_t timer_;
+    uint8_t mode_;
+    uint8_t player_;
+    bool imu_;
+    bool vibration_;
+    bool low_power_;
+    uint8_t mcu_state_;
+    uint8_t mcu_mode_;
+    uint8_t ir_mode_;
+    uint8_t ir_fragments_;
+    uint8_t ir_fragment_;
+    bool ir_sent_;
+    uint32_t ir_frame_;
+    uint64_t samples_;
+    VirtualStats stats_;
+
+    void *Stream();
+    void Format();
+    ssize_t Handle(const void *, size_t);
+    void Reply(uint8_t ack, uint8_t id, const void *data, size_t size);
+    void Subcmd(const OutputReport &);
+    void Mcu(const OutputReport &);
+    void Fragment(uint8_t);
+    void Header(InputReport &, uint8_t id);
+    void Imu(ImuData &);
+    int Send(const InputReport &, size_t);
+
+  public:
+    explicit VirtualController(Category category = JOYCON_L, unsigned period = VIRTUAL_PERIOD_DEFAULT);
+    ~VirtualController();
+    VirtualController(const VirtualController &) = delete;
+    VirtualController &operator=(const VirtualController &) = delete;
+    // recv_size is INPUT_REPORT_LARGE_SIZE to receive whole IR fragments
+    DeviceFunc Func(size_t recv_size = INPUT_REPORT_STAND_SIZE);
+    // buttons and sticks reported from now on
+    void SetData(const ControllerData &data);
+    void ReadFlash(uint32_t address, void *data, size_t size) const;
+    void GetStats(VirtualStats &stats) const;
+    uint8_t mode() const;
+    uint8_t player() const;
+    uint8_t mcu_mode() const;
+    // the byte of pixel `offset` in IR frame `frame`
+    static uint8_t Pixel(uint32_t frame, size_t offset) { return static_cast<uint8_t>(frame * 7 + offset); };
+};
+
+} // namespace virtual_device
+
+#endif // __cplusplus
+#endif // VIRTUAL_DEVICE_H
@@ -0,0 +1,249 @@
+/*
+ *   Copyright (c) 2020 mumumusuc
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "capture.h"
+#include "log.h"
+#include "output_report.h"
+#include "tools.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define DEBUG 1
+#if DEBUG
+#define debug(fmt, ...) log_d(__func__, fmt, ##__VA_ARGS__)
+#else
+#define debug(fmt, ...)
+#endif
+
+using namespace capture;
+
+static const uint8_t PADDING[8] = {};
+
+Recorder::Recorder(const char *path, const DeviceFunc &remote) : remote_(remote), fd_(-1), start_(monotonic_ns()) {
+    CaptureHeader header = {};
+    header.magic = CAPTURE_MAGIC;
+    header.version = CAPTURE_VERSION;
+    header.start = start_;
+    fd_ = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0)
+        throw std::runtime_error(strerror(errno));
+    if (write(fd_, &header, sizeof(header)) != sizeof(header)) {
+        int ret = errno;
+        close(fd_);
+        throw std::runtime_error(strerror(ret));
+    }
+}
+
+Recorder::~Recorder() { close(fd_); }
+
+// one writev for each record, a crash leaves whole records behind
+void Recorder::Append(uint8_t dir, const void *data, size_t size) {
+    CaptureRecord record = {};
+    record.size = static_cast<uint16_t>(size);
+    record.dir = dir;
+    struct iovec iov[3] = {
+        {.iov_base = &record, .iov_len = sizeof(record)},
+        {.iov_base = const_cast<void *>(data), .iov_len = size},
+        {.iov_base = const_cast<uint8_t *>(PADDING), .iov_len = capture_record_size(size) - sizeof(record) - size},
+    };
+    std::lock_guard<std::mutex> lock(lock_);
+    record.time = monotonic_ns() - start_;
+    if (writev(fd_, iov, 3) < 0)
+        debug("write error %d", errno);
+}
+
+DeviceFunc Recorder::Func() {
+    DeviceFunc func = remote_;
+    if (remote_.sender)
+        func.sender = [this](const void *buffer, size_t size) -> ssize_t {
+            ssize_t ret = remote_.sender(buffer, size);
+            if (ret > 0)
+                Append(CAPTURE_OUTPUT, buffer, ret);
+            return ret;
+        };
+    if (remote_.recver)
+        func.recver = [this](void *buffer, size_t size) -> ssize_t {
+            ssize_t ret = remote_.recver(buffer, size);
+            if (ret > 0)
+                Append(CAPTURE_INPUT, buffer, ret);
+            return ret;
+        };
+    if (remote_.batch_recver)
+        func.batch_recver = [this](void *buffer, size_t stride, size_t count, size_t *sizes) -> ssize_t {
+            ssize_t ret = remote_.batch_recver(buffer, stride, count, sizes);
+            for (ssize_t i = 0; i < ret; ++i)
+                Append(CAPTURE_INPUT, reinterpret_cast<uint8_t *>(buffer) + i * stride, sizes[i]);
+            return ret;
+        };
+    return func;
+}
+
+Replay::Replay(const char *path, ReplayMode mode)
+    : mode_(mode), size_(0), map_(nullptr), offset_(sizeof(CaptureHeader)), inputs_(0), fed_(0), sent_(0),
+      timer_fd_(-1), start_(0) {
+    int ret = 0;
+    struct stat st;
+    const CaptureHeader *header = nullptr;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+        goto error;
+    size_ = st.st_size;
+    ret = EINVAL;
+    if (size_ < sizeof(CaptureHeader))
+        goto error;
+    map_ = reinterpret_cast<uint8_t *>(mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0));
+    if (map_ == MAP_FAILED) {
+        map_ = nullptr;
+        ret = errno;
+        goto error;
+    }
+    close(fd);
+    fd = -1;
+    header = reinterpret_cast<const CaptureHeader *>(map_);
+    if (header->magic != CAPTURE_MAGIC || header->version != CAPTURE_VERSION)
+        goto error;
+    // count the inputs, then rewind
+    while (Next()) {
+        inputs_++;
+        offset_ += capture_record_size(reinterpret_cast<const CaptureRecord *>(map_ + offset_)->size);
+    }
+    offset_ = sizeof(CaptureHeader);
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer_fd_ < 0)
+        goto error;
+    return;
+
+error:
+    if (ret == 0)
+        ret = errno;
+    if (fd >= 0)
+        close(fd);
+    if (map_)
+        munmap(map_, size_);
+    throw std::runtime_error(strerror(ret));
+}
+
+Replay::~Replay() {
+    close(timer_fd_);
+    munmap(map_, size_);
+}
+
+// the next input record at or after offset_, nullptr at the end or at a record cut short
+inline const CaptureRecord *Replay::Next() {
+    while (offset_ + sizeof(CaptureRecord) <= size_) {
+        auto record = reinterpret_cast<const CaptureRecord *>(map_ + offset_);
+        if (offset_ + capture_record_size(record->size) > size_)
+            break;
+        if (record->dir == CAPTURE_INPUT)
+            return record;
+        offset_ += capture_record_size(record->size);
+    }
+    offset_ = size_;
+    return nullptr;
+}
+
+// Keep poll_fd readable while a report is due. A fast replay leaves the timer expired until the
+// end, a timed one arms it for the next report.
+inline void Replay::Arm() {
+    uint64_t expirations = 0;
+    struct itimerspec spec = {};
+    const CaptureRecord *record = Next();
+    if (mode_ == REPLAY_FAST && record)
+        return;
+    if (read(timer_fd_, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        debug("timer error %d", errno);
+    if (record) {
+        uint64_t due = start_ + record->time;
+        spec.it_value.tv_sec = due / 1000000000ull;
+        spec.it_value.tv_nsec = due % 1000000000ull;
+    }
+    if (timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+        debug("timer error %d", errno);
+}
+
+inline ssize_t Replay::Recv(void *buffer, size_t size) {
+    const CaptureRecord *record = Next();
+    if (!record)
+        return 0;
+    if (mode_ == REPLAY_TIMED && monotonic_ns() < start_ + record->time) {
+        Arm();
+        return 0;
+    }
+    size = size < record->size ? size : record->size;
+    memcpy(buffer, record->data, size);
+    offset_ += capture_record_size(record->size);
+    fed_++;
+    Arm();
+    return size;
+}
+
+DeviceFunc Replay::Func(size_t recv_size) {
+    DeviceFunc func = {};
+    struct itimerspec spec = {};
+    func.sender = [this](const void *buffer, size_t size) -> ssize_t {
+        std::lock_guard<std::mutex> lock(lock_);
+        sent_++;
+        return size;
+    };
+    func.recver = [this](void *buffer, size_t size) -> ssize_t {
+        std::lock_guard<std::mutex> lock(lock_);
+        return Recv(buffer, size);
+    };
+    func.send_size = OUTPUT_REPORT_SIZE;
+    func.recv_size = recv_size;
+    func.batch_recver = [this](void *buffer, size_t stride, size_t count, size_t *sizes) -> ssize_t {
+        auto dst = reinterpret_cast<uint8_t *>(buffer);
+        std::lock_guard<std::mutex> lock(lock_);
+        size_t n = 0;
+        for (; n < count; ++n) {
+            ssize_t ret = Recv(dst + n * stride, stride);
+            if (ret <= 0)
+                break;
+            sizes[n] = ret;
+        }
+        return n;
+    };
+    func.poll_fd = timer_fd_;
+    func.pollable = true;
+    std::lock_guard<std::mutex> lock(lock_);
+    start_ = monotonic_ns();
+    // expire now, Arm() takes over from the first report
+    spec.it_value.tv_nsec = 1;
+    timerfd_settime(timer_fd_, 0, &spec, NULL);
+    return func;
+}
+
+size_t Replay::fed() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return fed_;
+}
+
+size_t Replay::sent() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return sent_;
+}
+
+bool Replay::Done() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return Next() == nullptr;
+}
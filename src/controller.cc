@@ -20,13 +20,14 @@
 #include "input_report.h"
 #include "log.h"
 #include "output_report.h"
+#include <algorithm>
 #include <assert.h>
 #include <chrono>
 #include <future>
 #include <math.h>
 #include <stdarg.h>
 
-#define RETRY 10
+#define TIMEOUT 160 // ms
 #define DEBUG 1
 #if DEBUG
 #define debug(fmt, ...) log_d(__func__, fmt, ##__VA_ARGS__)
@@ -71,40 +72,102 @@ class Counter {
 };
 
 template <typename T>
-static inline int transmit(unsigned retry, const void *buffer, Inspector inspector,
-                           std::vector<std::future<Result>> &result, const T &session) {
-    result.emplace_back(std::move(session->Transmit(retry, buffer, inspector)));
+static inline int transmit(unsigned timeout, const void *buffer, const Route &route, Inspector inspector,
+                           std::vector<Future> &result, const T &session) {
+    result.emplace_back(session->Transmit(timeout, buffer, route, inspector));
     return 0;
 }
 
+// send without a reply to wait for, safe from an inspector running on the poll thread
 template <typename T>
-static inline int aquire(unsigned retry, Inspector inspector,
-                         std::vector<std::future<Result>> &result, const T &session) {
-    result.emplace_back(std::move(session->Acquire(retry, inspector)));
+static inline int post(const void *buffer, const T &session) {
+    session->Transmit(0, buffer, Route(), nullptr);
     return 0;
 }
 
 template <typename... Args>
 static inline void nop(Args... args) {}
 
+static inline bool has_controller_data(const InputReport &report) {
+    return report.id == 0x30 || report.id == 0x21 || report.id == 0x31;
+}
+
+template <typename... Args>
+static inline bool all_done(Args... args) {
+    int results[] = {DONE, args...};
+    for (int ret : results)
+        if (ret != DONE) return false;
+    return true;
+}
+
+// A command first waits for the oldest ones while the window is full, and for the one in
+// flight with the same route, as replies are only told apart by their subcmd id.
 template <typename... Args>
 inline void
-ControllerImpl::Transmit(unsigned retry, const void *buffer, Inspector inspector, const Args &... sessions) {
-    results_.clear();
-    assert(results_.empty());
-    nop(transmit(retry, buffer, inspector, results_, sessions)...);
+ControllerImpl::Transmit(unsigned timeout, const void *buffer, Route route, Inspector inspector, const Args &... sessions) {
+    size_t wait = pending_.size() < window_ ? 0 : pending_.size() - window_ + 1;
+    for (size_t i = wait; i < pending_.size(); ++i)
+        if (pending_[i].route.id == route.id && pending_[i].route.subcmd == route.subcmd)
+            wait = i + 1;
+    while (wait--)
+        Retire();
+    nop(transmit(timeout, buffer, route, inspector, results_, sessions)...);
+    pending_.push_back({route, sizeof...(sessions)});
 }
 
+// Wait for the oldest command in flight and return its result. The first failure of a
+// batch is kept for Commit().
+inline int ControllerImpl::Retire() {
+    int ret = 0;
+    size_t count = pending_.front().count;
+    for (size_t i = 0; i < count; ++i) {
+        ret = results_[i].Get();
+        if (ret != DONE && batch_ret_ == DONE)
+            batch_ret_ = ret;
+    }
+    results_.erase(results_.begin(), results_.begin() + count);
+    pending_.erase(pending_.begin());
+    return ret;
+}
+
+// wait for all commands in flight, returns the result of the last one
 inline int ControllerImpl::Await() {
     int ret = 0;
-    for (auto it = results_.begin(); it != results_.end(); ++it)
-        ret = (*it).get();
+    while (!pending_.empty())
+        ret = Retire();
     return ret;
 }
 
-ControllerImpl::ControllerImpl(const Device *host) : host_(*host) {
+// Await, unless commands are pipelined. Only commands whose inspector captures nothing
+// may be deferred, the caller's frame is gone before the reply arrives.
+inline int ControllerImpl::Defer() {
+    if (window_ > 1)
+        return WAITING;
+    return Await();
+}
+
+int ControllerImpl::Begin(unsigned window) {
+    GuardLock lock(sess_lock_);
+    Await();
+    window_ = window > 0 ? window : 1;
+    batch_ret_ = DONE;
+    return DONE;
+}
+
+int ControllerImpl::Commit() {
+    GuardLock lock(sess_lock_);
+    Await();
+    int ret = batch_ret_;
+    window_ = 1;
+    batch_ret_ = DONE;
+    return ret;
+}
+
+ControllerImpl::ControllerImpl(const Device *host)
+    : window_(1), batch_ret_(DONE), host_(*host), push_type_(session::FREE) {
     int ret = 0;
     results_.reserve(8);
+    pending_.reserve(8);
     output_ = reinterpret_cast<OutputReport *>(calloc(1, OUTPUT_REPORT_SIZE));
     if (output_ == nullptr) {
         throw std::runtime_error(strerror(ENOMEM));
@@ -114,10 +177,26 @@ ControllerImpl::ControllerImpl(const Device *host) : host_(*host) {
 ControllerImpl::~ControllerImpl() {
     int ret = 0;
     results_.clear();
+    pending_.clear();
     free(output_);
     assert(ret == 0);
 }
 
+// Sessions opened over host_ share its sender. QUEUED ones call it from their own push
+// threads, so the calls are serialized.
+Session *ControllerImpl::OpenDevice(unsigned int, ...) {
+    DeviceFunc func = host_.func;
+    if (push_type_ == session::QUEUED && func.sender) {
+        auto sender = func.sender;
+        auto lock = &send_lock_;
+        func.sender = [sender, lock](const void *buffer, size_t size) -> ssize_t {
+            GuardLock _1(*lock);
+            return sender(buffer, size);
+        };
+    }
+    return new Session(&func, nullptr, push_type_);
+}
+
 template <typename... Args>
 int ControllerImpl::Pair(const Args &... sessions) {
     debug();
@@ -137,8 +216,9 @@ int ControllerImpl::Pair(const Args &... sessions) {
                 return DONE;
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x21, SUBCMD_01), inspector, sessions...);
     }
+    // not deferred, the calibration is read once the pairing is done
     ret = Await();
     return ret;
 }
@@ -161,9 +241,9 @@ int ControllerImpl::Poll(PollType type, const Args &... sessions) {
                 return DONE;
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x21, SUBCMD_03), inspector, sessions...);
     }
-    ret = Await();
+    ret = Defer();
     return ret;
 }
 
@@ -173,7 +253,7 @@ int ControllerImpl::GetData(ControllerData &data, const Args &... sessions) {
     int ret = 0;
     auto inspector = [&data](const void *input) -> int {
         auto buffer = static_cast<const InputReport *>(input);
-        if (buffer->id == 0x30 || buffer->id == 0x21 || buffer->id == 0x31) {
+        if (has_controller_data(*buffer)) {
             if (buffer->controller_state.category == PRO_GRIP)
                 data = buffer->controller_data;
             else
@@ -182,11 +262,100 @@ int ControllerImpl::GetData(ControllerData &data, const Args &... sessions) {
         }
         return WAITING;
     };
-    Transmit(RETRY, nullptr, inspector, sessions...);
+    GuardLock lock(sess_lock_);
+    Transmit(TIMEOUT, nullptr, Route(), inspector, sessions...);
     ret = Await();
     return ret;
 }
 
+template <typename T>
+static inline int state(ControllerData &data, const T &session) {
+    InputState input;
+    if (!session->GetState(input))
+        return WAITING;
+    if (input.controller_state.category == PRO_GRIP)
+        data = input.controller_data;
+    else
+        controller_data_merge(&data, &input.controller_data);
+    return DONE;
+}
+
+// no lock, the sessions keep their latest state
+template <typename... Args>
+int ControllerImpl::GetState(ControllerData &data, const Args &... sessions) {
+    ControllerData merged;
+    bzero(&merged, sizeof(merged));
+    if (!all_done(state(merged, sessions)...))
+        return WAITING;
+    data = merged;
+    return DONE;
+}
+
+// wait for the next report of first, then merge the latest of the others
+template <typename T, typename... Args>
+int ControllerImpl::WaitState(ControllerData &data, unsigned timeout, const T &first, const Args &... others) {
+    InputState input;
+    first->GetState(input);
+    int ret = first->WaitState(input, input.seq, timeout);
+    if (ret != DONE)
+        return ret;
+    return GetState(data, first, others...);
+}
+
+// A stick with a blank calibration block gets a nominal one.
+int ControllerImpl::Calibrate(uint16_t deadzone, Session *left, Session *right) {
+    debug();
+    int ret = DONE;
+    uint8_t block[FLASH_ADDR_STICK_CALIB_LEN];
+    StickCalibration calibration;
+    const struct {
+        Session *session;
+        uint32_t address;
+        bool right;
+    } sides[] = {
+        {left, FLASH_ADDR_STICK_L_CALIB, false},
+        {right, FLASH_ADDR_STICK_R_CALIB, true},
+    };
+    for (auto &side : sides) {
+        if (!side.session)
+            continue;
+        ret = ReadMemory(side.address, sizeof(block), block, side.session);
+        if (ret != DONE)
+            return ret;
+        if (!calibration.Parse(block, side.right))
+            debug("blank %s stick calibration", side.right ? "right" : "left");
+        GuardLock lock(sticks_lock_);
+        sticks_.Load(side.right, calibration, deadzone);
+    }
+    return ret;
+}
+
+template <typename... Args>
+int ControllerImpl::GetSticks(Sticks &sticks, const Args &... sessions) {
+    ControllerData data;
+    int ret = GetState(data, sessions...);
+    if (ret == DONE) {
+        GuardLock lock(sticks_lock_);
+        sticks_.Decode(data, sticks);
+    }
+    return ret;
+}
+
+template <typename T>
+static inline int button_events(ButtonEvent *events, size_t count, size_t &n, const T &session) {
+    n += session->ReadButtonEvents(events + n, count - n);
+    return 0;
+}
+
+template <typename... Args>
+size_t ControllerImpl::GetButtonEvents(ButtonEvent *events, size_t count, const Args &... sessions) {
+    size_t n = 0;
+    nop(button_events(events, count, n, sessions)...);
+    if (sizeof...(sessions) > 1)
+        std::stable_sort(events, events + n, [](const ButtonEvent &a, const ButtonEvent &b) { return a.time < b.time; });
+    return n;
+}
+
 template <typename... Args>
 int ControllerImpl::SetPlayer(Player player, PlayerFlash flash, const Args &... sessions) {
     debug();
@@ -206,9 +375,9 @@ int ControllerImpl::SetPlayer(Player player, PlayerFlash flash, const Args &...
                 return DONE;
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x21, SUBCMD_30), inspector, sessions...);
     }
-    ret = Await();
+    ret = Defer();
     return ret;
 }
 
@@ -230,9 +399,9 @@ int ControllerImpl::SetLowPower(bool enable, const Args &... sessions) {
                 return DONE;
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x21, SUBCMD_08), inspector, sessions...);
     }
-    ret = Await();
+    ret = Defer();
     return ret;
 }
 
@@ -253,9 +422,9 @@ int ControllerImpl::SetElapsedTime(uint8_t time, const Args &... sessions) {
                 return DONE;
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x21, SUBCMD_04), inspector, sessions...);
     }
-    ret = Await();
+    ret = Defer();
     return ret;
 }
 
@@ -276,9 +445,9 @@ int ControllerImpl::SetImu(bool enable, const Args &... sessions) {
                 return DONE;
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x21, SUBCMD_40), inspector, sessions...);
     }
-    ret = Await();
+    ret = Defer();
     return ret;
 }
 
@@ -313,7 +482,7 @@ int ControllerImpl::ReadMemory(uint32_t address, uint8_t size, void *data, const
             }
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x21, SUBCMD_10), inspector, sessions...);
     }
     ret = Await();
     return ret;
@@ -336,7 +505,7 @@ int ControllerImpl::WriteMemory(uint32_t address, uint8_t size, const void *data
         output_->subcmd_11.address = address;
         output_->subcmd_11.length = size;
         memmove(output_->subcmd_11.data, data, size);
-        auto inspector = [&address, &size, &data](const void *input) -> int {
+        auto inspector = [](const void *input) -> int {
             auto buffer = static_cast<const InputReport *>(input);
             if (buffer->id == 0x21 && buffer->reply.subcmd_id == SUBCMD_11) {
                 uint8_t status = buffer->reply.data[0];
@@ -349,9 +518,9 @@ int ControllerImpl::WriteMemory(uint32_t address, uint8_t size, const void *data
             }
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x21, SUBCMD_11), inspector, sessions...);
     }
-    ret = Await();
+    ret = Defer();
     return ret;
 }
 
@@ -437,9 +606,9 @@ int ControllerImpl::SetRumble(bool enable, const Args &... sessions) {
                 return DONE;
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x21, SUBCMD_48), inspector, sessions...);
     }
-    ret = Await();
+    ret = Defer();
     return ret;
 }
 
@@ -448,6 +617,7 @@ int ControllerImpl::Rumble(const rumble_data_t *left, const rumble_data_t *right
                            const Args &... sessions) {
     if (!left && !right) return 0;
     int ret = 0;
+    GuardLock lock(sess_lock_);
     {
         GuardLock _1(output_lock_);
         bzero(output_, OUTPUT_REPORT_SIZE);
@@ -456,9 +626,9 @@ int ControllerImpl::Rumble(const rumble_data_t *left, const rumble_data_t *right
             output_->rumble.rumble_l = *left;
         if (right)
             output_->rumble.rumble_r = *right;
-        Transmit(RETRY, output_, nullptr, sessions...);
+        Transmit(TIMEOUT, output_, Route(), nullptr, sessions...);
     }
-    ret = Await();
+    ret = Defer();
     return ret;
 }
 
@@ -528,9 +698,9 @@ int ControllerImpl::SetMcuState(McuState state, const Args &... sessions) {
                 return DONE;
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x21, SUBCMD_22), inspector, sessions...);
     }
-    ret = Await();
+    ret = Defer();
     return ret;
 }
 
@@ -557,7 +727,7 @@ int ControllerImpl::CheckMcuMode(McuMode mode, const Args &... sessions) {
                 return DONE;
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x31), inspector, sessions...);
     }
     ret = Await();
     return ret;
@@ -589,9 +759,9 @@ int ControllerImpl::SetMcuMode(McuMode mode, const Args &... sessions) {
                 return DONE;
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x21, SUBCMD_21), inspector, sessions...);
     }
-    ret = Await();
+    ret = Defer();
     return ret;
 }
 
@@ -619,9 +789,9 @@ int ControllerImpl::SetHomeLight(uint8_t intensity, uint8_t duration, uint8_t re
                 return DONE;
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x21, SUBCMD_38), inspector, sessions...);
     }
-    ret = Await();
+    ret = Defer();
     return ret;
 };
 
@@ -645,7 +815,7 @@ int ControllerImpl::CheckMcuIrMode(IrMode mode, const Args &... sessions) {
                 return DONE;
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x31), inspector, sessions...);
     }
     ret = Await();
     return ret;
@@ -679,7 +849,7 @@ int ControllerImpl::SetMcuIrRegisters(const McuReg *regs, size_t size, const Arg
             bzero(dist, sizeof(McuReg) * 9);
             memmove(dist, regs + count, sizeof(McuReg) * trunk);
             calc_crc8_21(output_);
-            Transmit(RETRY, output_, inspector, sessions...);
+            Transmit(TIMEOUT, output_, Route(0x21, SUBCMD_21), inspector, sessions...);
             ret = Await();
             if (ret != DONE)
                 break;
@@ -692,9 +862,10 @@ int ControllerImpl::SetMcuIrRegisters(const McuReg *regs, size_t size, const Arg
 template <typename... Args>
 int ControllerImpl::SetMcuIrConfig(const IrConfigFixed &fixed, const Args &... sessions) {
     int ret = 0;
-    GuardLock lock(sess_lock_);
     {
-        GuardLock lock(output_lock_);
+        // released before SetMcuIrRegisters takes it again
+        GuardLock _1(sess_lock_);
+        GuardLock _2(output_lock_);
         bzero(output_, OUTPUT_REPORT_SIZE);
         output_->id = OUTPUT_REPORT_CMD;
         output_->subcmd_21 = SUBCMD_21_INIT;
@@ -712,9 +883,9 @@ int ControllerImpl::SetMcuIrConfig(const IrConfigFixed &fixed, const Args &... s
                 return DONE;
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x21, SUBCMD_21), inspector, sessions...);
+        ret = Await();
     }
-    ret = Await();
     if (ret != DONE)
         return ret;
     const McuReg regs[] = {
@@ -856,8 +1027,7 @@ int ControllerImpl::GetIrImage(const IrConfigFixed &fixed, uint8_t *image, IrCal
                 output_->subcmd_03.raw[3] = cur_frag_no;
                 calc_crc8_03(output_);
                 debug("ack for fragment %u", cur_frag_no);
-                Transmit(0, output_, nullptr, sessions...);
-                Await();
+                nop(post(output_, sessions)...);
                 return AGAIN;
             } else if (buffer->id == 0x31) {
                 // Empty IR report. Send Ack again. Otherwise, it fallbacks to
@@ -876,13 +1046,12 @@ int ControllerImpl::GetIrImage(const IrConfigFixed &fixed, uint8_t *image, IrCal
                     output_->subcmd_03.raw[3] = 0x0;
                 }
                 calc_crc8_03(output_);
-                Transmit(0, output_, nullptr, sessions...);
-                Await();
+                nop(post(output_, sessions)...);
                 return AGAIN;
             }
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x31), inspector, sessions...);
     }
     ret = Await();
     return ret;
@@ -989,7 +1158,7 @@ int ControllerImpl::SetMcuNfcConfig(const Args &... sessions) {
             }
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x31), inspector, sessions...);
     }
     ret = Await();
     assert(ret == DONE);
@@ -1041,7 +1210,7 @@ int ControllerImpl::SetMcuNfcConfig(const Args &... sessions) {
             }
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x31), inspector, sessions...);
     }
     ret = Await();
     return ret;
@@ -1143,7 +1312,7 @@ int ControllerImpl::GetNfcNtag(const Args &... sessions) {
             }
             return WAITING;
         };
-        Transmit(RETRY, output_, inspector, sessions...);
+        Transmit(TIMEOUT, output_, Route(0x31), inspector, sessions...);
     }
     ret = Await();
     return ret;
@@ -1203,11 +1372,25 @@ JoyCon_L::JoyCon_L(ControllerImpl *impl) : impl_(impl) {
     session_ = std::unique_ptr<Session>(impl_->OpenDevice(1, PID));
 };
 
-int JoyCon_L::Pair() { return impl_->Pair(session_); };
+// The sticks are calibrated once paired. A failed flash read keeps the nominal calibration
+// and does not fail the pairing.
+int JoyCon_L::Pair() {
+    int ret = impl_->Pair(session_);
+    if (ret == DONE)
+        Calibrate(STICK_DEADZONE_DEFAULT);
+    return ret;
+};
+int JoyCon_L::Calibrate(uint16_t deadzone) { return impl_->Calibrate(deadzone, session_.get(), nullptr); };
+int JoyCon_L::GetSticks(Sticks &sticks) { return impl_->GetSticks(sticks, session_); };
+size_t JoyCon_L::GetButtonEvents(ButtonEvent *events, size_t count) {
+    return impl_->GetButtonEvents(events, count, session_);
+};
 int JoyCon_L::Poll(PollType type) { return impl_->Poll(type, session_); };
 int JoyCon_L::BackupMemory(Progress progress) { return impl_->BackupMemory(progress, session_); };
 int JoyCon_L::RestoreMemory(Progress progress) { return impl_->RestoreMemory(progress, session_); };
 int JoyCon_L::GetData(ControllerData &data) { return impl_->GetData(data, session_); };
+int JoyCon_L::GetState(ControllerData &data) { return impl_->GetState(data, session_); };
+int JoyCon_L::WaitState(ControllerData &data, unsigned timeout) { return impl_->WaitState(data, timeout, session_); };
 int JoyCon_L::GetColor(ControllerColor &color) { return impl_->GetColor(color, session_); };
 int JoyCon_L::SetColor(const ControllerColor &color) { return impl_->SetColor(color, session_); };
 int JoyCon_L::SetLowPower(bool enable) { return impl_->SetLowPower(enable, session_); };
@@ -1222,16 +1405,30 @@ int JoyCon_L::Rumble(const rumble_data_t *left, const rumble_data_t *right) {
 int JoyCon_L::Rumblef(const rumble_data_f_t *left, const rumble_data_f_t *right) {
     return impl_->Rumblef(left, right, session_);
 };
+int JoyCon_L::Begin(unsigned window) { return impl_->Begin(window); };
+int JoyCon_L::Commit() { return impl_->Commit(); };
 
 JoyCon_R::JoyCon_R(const Device &host) : JoyCon_R(new ControllerImpl(&host)){};
 JoyCon_R::JoyCon_R(ControllerImpl *impl) : impl_(impl) {
     session_ = std::unique_ptr<Session>(impl_->OpenDevice(1, PID));
 };
-int JoyCon_R::Pair() { return impl_->Pair(session_); };
+int JoyCon_R::Pair() {
+    int ret = impl_->Pair(session_);
+    if (ret == DONE)
+        Calibrate(STICK_DEADZONE_DEFAULT);
+    return ret;
+};
+int JoyCon_R::Calibrate(uint16_t deadzone) { return impl_->Calibrate(deadzone, nullptr, session_.get()); };
+int JoyCon_R::GetSticks(Sticks &sticks) { return impl_->GetSticks(sticks, session_); };
+size_t JoyCon_R::GetButtonEvents(ButtonEvent *events, size_t count) {
+    return impl_->GetButtonEvents(events, count, session_);
+};
 int JoyCon_R::Poll(PollType type) { return impl_->Poll(type, session_); };
 int JoyCon_R::BackupMemory(Progress progress) { return impl_->BackupMemory(progress, session_); };
 int JoyCon_R::RestoreMemory(Progress progress) { return impl_->RestoreMemory(progress, session_); };
 int JoyCon_R::GetData(ControllerData &data) { return impl_->GetData(data, session_); };
+int JoyCon_R::GetState(ControllerData &data) { return impl_->GetState(data, session_); };
+int JoyCon_R::WaitState(ControllerData &data, unsigned timeout) { return impl_->WaitState(data, timeout, session_); };
 int JoyCon_R::GetColor(ControllerColor &color) { return impl_->GetColor(color, session_); };
 int JoyCon_R::SetColor(const ControllerColor &color) { return impl_->SetColor(color, session_); };
 int JoyCon_R::SetLowPower(bool enable) { return impl_->SetLowPower(enable, session_); };
@@ -1246,6 +1443,8 @@ int JoyCon_R::Rumble(const rumble_data_t *left, const rumble_data_t *right) {
 int JoyCon_R::Rumblef(const rumble_data_f_t *left, const rumble_data_f_t *right) {
     return impl_->Rumblef(left, right, session_);
 };
+int JoyCon_R::Begin(unsigned window) { return impl_->Begin(window); };
+int JoyCon_R::Commit() { return impl_->Commit(); };
 int JoyCon_R::SetMcuState(McuState state) { return impl_->SetMcuState(state, session_); };
 int JoyCon_R::SetMcuMode(McuMode mode) { return impl_->SetMcuMode(mode, session_); };
 int JoyCon_R::CheckMcuMode(McuMode mode) { return impl_->CheckMcuMode(mode, session_); };
@@ -1276,7 +1475,17 @@ int JoyCon_R::TestIR(int mode, uint8_t *buffer, IrCallback cb) {
 
 ProController::ProController(const Device &host) : ProController(new ControllerImpl(&host)){};
 ProController::ProController(ControllerImpl *impl) : impl_(impl) { session_ = std::unique_ptr<Session>(impl_->OpenDevice(1, PID)); };
-int ProController::Pair() { return impl_->Pair(session_); };
+int ProController::Pair() {
+    int ret = impl_->Pair(session_);
+    if (ret == DONE)
+        Calibrate(STICK_DEADZONE_DEFAULT);
+    return ret;
+};
+int ProController::Calibrate(uint16_t deadzone) { return impl_->Calibrate(deadzone, session_.get(), session_.get()); };
+int ProController::GetSticks(Sticks &sticks) { return impl_->GetSticks(sticks, session_); };
+size_t ProController::GetButtonEvents(ButtonEvent *events, size_t count) {
+    return impl_->GetButtonEvents(events, count, session_);
+};
 int ProController::Poll(PollType type) { return impl_->Poll(type, session_); };
 int ProController::BackupMemory(Progress progress) {
     return impl_->BackupMemory(progress, session_);
@@ -1285,6 +1494,8 @@ int ProController::RestoreMemory(Progress progress) {
     return impl_->RestoreMemory(progress, session_);
 };
 int ProController::GetData(ControllerData &data) { return impl_->GetData(data, session_); };
+int ProController::GetState(ControllerData &data) { return impl_->GetState(data, session_); };
+int ProController::WaitState(ControllerData &data, unsigned timeout) { return impl_->WaitState(data, timeout, session_); };
 int ProController::GetColor(ControllerColor &color) { return impl_->GetColor(color, session_); };
 int ProController::SetColor(const ControllerColor &color) { return impl_->SetColor(color, session_); };
 int ProController::SetLowPower(bool enable) { return impl_->SetLowPower(enable, session_); };
@@ -1299,6 +1510,8 @@ int ProController::Rumble(const rumble_data_t *left, const rumble_data_t *right)
 int ProController::Rumblef(const rumble_data_f_t *left, const rumble_data_f_t *right) {
     return impl_->Rumblef(left, right, session_);
 };
+int ProController::Begin(unsigned window) { return impl_->Begin(window); };
+int ProController::Commit() { return impl_->Commit(); };
 int ProController::SetMcuState(McuState state) { return impl_->SetMcuState(state, session_); };
 int ProController::SetMcuMode(McuMode mode) { return impl_->SetMcuMode(mode, session_); };
 int ProController::CheckMcuMode(McuMode mode) { return impl_->CheckMcuMode(mode, session_); };
@@ -1311,11 +1524,25 @@ int ProController::GetNfcNtag() { return -1; };
 int ProController::GetNfcData() { return -1; };
 
 JoyCon_Dual::JoyCon_Dual(const Device &host) : JoyCon_Dual(new ControllerImpl(&host)){};
+// Both sessions send from their push threads, so a command reaches both sides at once and
+// takes as long as the slower one, not their sum. Over a single device both sides share its
+// sender and take turns, only an impl opening a device per side sends in parallel.
 JoyCon_Dual::JoyCon_Dual(ControllerImpl *impl) : impl_(impl) {
+    impl_->push_type_ = session::QUEUED;
     session_l_ = std::unique_ptr<Session>(impl_->OpenDevice(1, JoyCon_L::PID));
     session_r_ = std::unique_ptr<Session>(impl_->OpenDevice(1, JoyCon_R::PID));
 };
-int JoyCon_Dual::Pair() { return impl_->Pair(session_l_, session_r_); };
+int JoyCon_Dual::Pair() {
+    int ret = impl_->Pair(session_l_, session_r_);
+    if (ret == DONE)
+        Calibrate(STICK_DEADZONE_DEFAULT);
+    return ret;
+};
+int JoyCon_Dual::Calibrate(uint16_t deadzone) { return impl_->Calibrate(deadzone, session_l_.get(), session_r_.get()); };
+int JoyCon_Dual::GetSticks(Sticks &sticks) { return impl_->GetSticks(sticks, session_l_, session_r_); };
+size_t JoyCon_Dual::GetButtonEvents(ButtonEvent *events, size_t count) {
+    return impl_->GetButtonEvents(events, count, session_l_, session_r_);
+};
 int JoyCon_Dual::Poll(PollType type) { return impl_->Poll(type, session_l_, session_r_); };
 int JoyCon_Dual::BackupMemory(Progress progress) {
     return impl_->BackupMemory(progress, session_l_, session_r_);
@@ -1326,6 +1553,10 @@ int JoyCon_Dual::RestoreMemory(Progress progress) {
 int JoyCon_Dual::GetData(ControllerData &data) {
     return impl_->GetData(data, session_l_, session_r_);
 };
+int JoyCon_Dual::GetState(ControllerData &data) { return impl_->GetState(data, session_l_, session_r_); };
+int JoyCon_Dual::WaitState(ControllerData &data, unsigned timeout) {
+    return impl_->WaitState(data, timeout, session_l_, session_r_);
+};
 int JoyCon_Dual::GetColor(ControllerColor &color) {
     return impl_->GetColor(color, session_l_, session_r_);
 };
@@ -1346,6 +1577,8 @@ int JoyCon_Dual::Rumble(const rumble_data_t *left, const rumble_data_t *right) {
 int JoyCon_Dual::Rumblef(const rumble_data_f_t *left, const rumble_data_f_t *right) {
     return impl_->Rumblef(left, right, session_l_, session_r_);
 };
+int JoyCon_Dual::Begin(unsigned window) { return impl_->Begin(window); };
+int JoyCon_Dual::Commit() { return impl_->Commit(); };
 int JoyCon_Dual::SetMcuState(McuState state) { return impl_->SetMcuState(state, session_r_); };
 int JoyCon_Dual::SetMcuMode(McuMode mode) { return impl_->SetMcuMode(mode, session_r_); };
 int JoyCon_Dual::CheckMcuMode(McuMode mode) { return impl_->CheckMcuMode(mode, session_r_); };
@@ -1361,6 +1594,8 @@ int calc_rumble_data(const rumble_data_f_t *rumblef, rumble_data_t *rumble) {
                        rumblef->freq_l_amp);
 }
 
+Controller *Controller_create(category_t category) { return OpenDevice(category); }
+
 void Controller_destroy(Controller *controller) { delete controller; }
 
 int Controller_pair(Controller *controller) {
@@ -1371,6 +1606,14 @@ int Controller_poll(Controller *controller, poll_type_t type) {
     return controller->Poll(type);
 }
 
+int Controller_begin(Controller *controller, unsigned window) {
+    return controller->Begin(window);
+}
+
+int Controller_commit(Controller *controller) {
+    return controller->Commit();
+}
+
 int Controller_set_low_power(Controller *controller, int enable) {
     return controller->SetLowPower(enable & 0x1);
 }
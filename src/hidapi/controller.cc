@@ -0,0 +1,136 @@
+/*
+ *   Copyright (c) 2020 mumumusuc
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "hidapi_controller.h"
+#include "log.h"
+#include <errno.h>
+#include <hidapi.h>
+#include <mutex>
+#include <stdarg.h>
+#include <wchar.h>
+
+#define RECV_TIMEOUT 16 // ms
+#define DEBUG 1
+#if DEBUG
+#define debug(fmt, ...) log_d(__func__, fmt, ##__VA_ARGS__)
+#else
+#define debug(fmt, ...)
+#endif
+
+using namespace hidapi;
+using namespace controller;
+
+// hid_init() and hid_exit() are process wide, count the impls using them
+static std::mutex hid_lock;
+static unsigned hid_users = 0;
+
+static inline void hid_error_d(hid_device *handle, const char *what) {
+    debug("%s error %ls", what, hid_error(handle) ? hid_error(handle) : L"unknown");
+}
+
+HidDevice::~HidDevice() {
+    if (handle_)
+        hid_close(handle_);
+}
+
+ssize_t HidDevice::Send(const void *buffer, size_t size) {
+    int ret = hid_write(handle_, reinterpret_cast<const unsigned char *>(buffer), size);
+    if (ret < 0)
+        hid_error_d(handle_, "write");
+    return ret < 0 ? -EIO : ret;
+}
+
+// returns 0 if no report came within timeout ms
+ssize_t HidDevice::Recv(void *buffer, size_t size, int timeout) {
+    int ret = hid_read_timeout(handle_, reinterpret_cast<unsigned char *>(buffer), size, timeout);
+    if (ret < 0)
+        hid_error_d(handle_, "read");
+    return ret < 0 ? -EIO : ret;
+}
+
+// the batch recver waits for the first report and takes the ones already queued after it
+DeviceFunc HidDevice::Func() {
+    DeviceFunc func = {};
+    func.sender = [this](const void *buffer, size_t size) { return Send(buffer, size); };
+    func.recver = [this](void *buffer, size_t size) { return Recv(buffer, size, RECV_TIMEOUT); };
+    func.send_size = OUTPUT_REPORT_SIZE;
+    func.recv_size = INPUT_REPORT_STAND_SIZE;
+    func.batch_recver = [this](void *buffer, size_t stride, size_t count, size_t *sizes) -> ssize_t {
+        auto dst = reinterpret_cast<uint8_t *>(buffer);
+        size_t n = 0;
+        for (; n < count; ++n) {
+            ssize_t ret = Recv(dst + n * stride, stride, n == 0 ? RECV_TIMEOUT : 0);
+            if (ret < 0)
+                return n > 0 ? n : ret;
+            if (ret == 0)
+                break;
+            sizes[n] = ret;
+        }
+        return n;
+    };
+    return func;
+}
+
+HidapiImpl::HidapiImpl(const Device *host, session::Reactor *reactor) : ControllerImpl(host), reactor_(reactor) {
+    std::lock_guard<std::mutex> lock(hid_lock);
+    if (hid_users++ == 0 && hid_init() != 0)
+        debug("hid_init error");
+}
+
+HidapiImpl::~HidapiImpl() {
+    // sessions over the devices are gone before the impl
+    opened_.clear();
+    std::lock_guard<std::mutex> lock(hid_lock);
+    if (--hid_users == 0)
+        hid_exit();
+}
+
+unsigned HidapiImpl::Users() {
+    std::lock_guard<std::mutex> lock(hid_lock);
+    return hid_users;
+}
+
+session::Session *HidapiImpl::OpenDevice(unsigned int count, ...) {
+    va_list args;
+    va_start(args, count);
+    unsigned short vid = count > 1 ? va_arg(args, int) : Controller::VID;
+    unsigned short pid = count > 0 ? va_arg(args, int) : 0;
+    va_end(args);
+    hid_device *handle = nullptr;
+    struct hid_device_info *devices = hid_enumerate(vid, pid);
+    for (auto info = devices; info && !handle; info = info->next) {
+        bool used = false;
+        for (auto &device : opened_)
+            used = used || device->path() == info->path;
+        if (used)
+            continue;
+        handle = hid_open_path(info->path);
+        if (!handle) {
+            debug("open %s failed", info->path);
+            continue;
+        }
+        debug("open %04hx:%04hx at %s", vid, pid, info->path);
+        opened_.emplace_back(new HidDevice(handle, info->path));
+    }
+    hid_free_enumeration(devices);
+    if (!handle)
+        throw std::runtime_error("no hidapi device found");
+    // blocking reads, bounded by RECV_TIMEOUT
+    hid_set_nonblocking(handle, 0);
+    DeviceFunc func = opened_.back()->Func();
+    return new session::Session(&func, reactor_, push_type_);
+}
@@ -0,0 +1,225 @@
+/*
+ *   Copyright (c) 2020 mumumusuc
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "hidraw.h"
+#include "log.h"
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#define SEND_TIMEOUT 16 // ms
+#define DEBUG 1
+#if DEBUG
+#define debug(fmt, ...) log_d(__func__, fmt, ##__VA_ARGS__)
+#else
+#define debug(fmt, ...)
+#endif
+
+using namespace hidraw;
+using namespace controller;
+
+static inline bool is_controller(uint16_t vendor, uint16_t product) {
+    return vendor == Controller::VID &&
+           (product == JoyCon_L::PID || product == JoyCon_R::PID || product == ProController::PID);
+}
+
+// parse HID_ID=<bus>:<vendor>:<product> and HID_UNIQ=<serial> of a uevent file
+static bool read_uevent(const std::string &path, DeviceInfo &info) {
+    char line[256];
+    unsigned bus = 0, vendor = 0, product = 0;
+    bool found = false;
+    FILE *file = fopen(path.c_str(), "re");
+    if (!file)
+        return false;
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "HID_ID=%x:%x:%x", &bus, &vendor, &product) == 3)
+            found = true;
+        else if (strncmp(line, "HID_UNIQ=", 9) == 0)
+            info.serial = line + 9;
+    }
+    fclose(file);
+    info.vendor = static_cast<uint16_t>(vendor);
+    info.product = static_cast<uint16_t>(product);
+    return found;
+}
+
+std::vector<DeviceInfo> hidraw::Enumerate(const char *sysfs, const char *dev) {
+    std::vector<DeviceInfo> devices;
+    struct dirent *entry;
+    DIR *dir = opendir(sysfs);
+    if (!dir) {
+        debug("open %s error %d", sysfs, errno);
+        return devices;
+    }
+    while ((entry = readdir(dir))) {
+        DeviceInfo info;
+        if (strncmp(entry->d_name, "hidraw", 6) != 0)
+            continue;
+        if (!read_uevent(std::string(sysfs) + "/" + entry->d_name + "/device/uevent", info))
+            continue;
+        if (!is_controller(info.vendor, info.product))
+            continue;
+        info.path = std::string(dev) + "/" + entry->d_name;
+        debug("found %04x:%04x at %s", info.vendor, info.product, info.path.c_str());
+        devices.emplace_back(std::move(info));
+    }
+    closedir(dir);
+    // readdir gives no order, keep hidraw0 before hidraw1 for the same setup
+    std::sort(devices.begin(), devices.end(), [](const DeviceInfo &a, const DeviceInfo &b) {
+        return a.path.size() != b.path.size() ? a.path.size() < b.path.size() : a.path < b.path;
+    });
+    return devices;
+}
+
+Hidraw::~Hidraw() {
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+Hidraw *Hidraw::Open(const char *path) {
+    int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC | O_NOCTTY);
+    if (fd < 0) {
+        debug("open %s error %d", path, errno);
+        return nullptr;
+    }
+    return new Hidraw(fd);
+}
+
+// wait for the fd to take the report instead of dropping it
+ssize_t Hidraw::Send(const void *buffer, size_t size) {
+    struct pollfd fds = {.fd = fd_, .events = POLLOUT, .revents = 0};
+    for (;;) {
+        ssize_t ret = write(fd_, buffer, size);
+        if (ret >= 0)
+            return ret;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN)
+            return -errno;
+        ret = poll(&fds, 1, SEND_TIMEOUT);
+        if (ret == 0)
+            return -EAGAIN;
+        if (ret < 0 && errno != EINTR)
+            return -errno;
+    }
+}
+
+ssize_t Hidraw::Recv(void *buffer, size_t size) {
+    for (;;) {
+        ssize_t ret = read(fd_, buffer, size);
+        if (ret >= 0)
+            return ret;
+        if (errno == EINTR)
+            continue;
+        return errno == EAGAIN ? 0 : -errno;
+    }
+}
+
+// the batch recver drains the reports queued at the fd, up to count
+DeviceFunc Hidraw::Func() {
+    DeviceFunc func = {};
+    func.sender = [this](const void *buffer, size_t size) { return Send(buffer, size); };
+    func.recver = [this](void *buffer, size_t size) { return Recv(buffer, size); };
+    func.send_size = OUTPUT_REPORT_SIZE;
+    func.recv_size = INPUT_REPORT_STAND_SIZE;
+    func.batch_recver = [this](void *buffer, size_t stride, size_t count, size_t *sizes) -> ssize_t {
+        auto dst = reinterpret_cast<uint8_t *>(buffer);
+        size_t n = 0;
+        for (; n < count; ++n) {
+            ssize_t ret = Recv(dst + n * stride, stride);
+            if (ret < 0)
+                return n > 0 ? n : ret;
+            if (ret == 0)
+                break;
+            sizes[n] = ret;
+        }
+        return n;
+    };
+    func.poll_fd = fd_;
+    func.pollable = true;
+    return func;
+}
+
+HidrawImpl::HidrawImpl(const Device *host, const std::vector<DeviceInfo> &devices, session::Reactor *reactor)
+    : ControllerImpl(host), devices_(devices), reactor_(reactor) {}
+
+// OpenDevice(1, pid) opens the first device with pid not opened yet
+session::Session *HidrawImpl::OpenDevice(unsigned int count, ...) {
+    va_list args;
+    va_start(args, count);
+    int pid = count > 0 ? va_arg(args, int) : 0;
+    va_end(args);
+    for (auto it = devices_.begin(); it != devices_.end(); ++it) {
+        if (it->product != pid)
+            continue;
+        std::unique_ptr<Hidraw> device(Hidraw::Open(it->path.c_str()));
+        if (!device)
+            continue;
+        DeviceFunc func = device->Func();
+        devices_.erase(it);
+        opened_.emplace_back(std::move(device));
+        return new session::Session(&func, reactor_, push_type_);
+    }
+    throw std::runtime_error("no hidraw device found");
+}
+
+static Controller *open_device(Category category, const std::vector<DeviceInfo> &devices) {
+    static const Device host = {.desc = sNintendoSwitch, .func = {}};
+    switch (category) {
+    case PRO_GRIP:
+        return new ProController(new HidrawImpl(&host, devices));
+    case JOYCON_L:
+        return new JoyCon_L(new HidrawImpl(&host, devices));
+    case JOYCON_R:
+        return new JoyCon_R(new HidrawImpl(&host, devices));
+    case JOYCON:
+        return new JoyCon_Dual(new HidrawImpl(&host, devices));
+    default:
+        return nullptr;
+    }
+}
+
+static inline Category category_of(uint16_t product) {
+    return product == JoyCon_L::PID ? JOYCON_L : product == JoyCon_R::PID ? JOYCON_R : PRO_GRIP;
+}
+
+Controller *controller::OpenDevice(Category category) noexcept {
+    try {
+        return open_device(category, Enumerate());
+    } catch (const std::exception &e) {
+        debug("open category %d error: %s", category, e.what());
+        return nullptr;
+    }
+}
+
+// one controller for each device found, joycons are not paired up into a JoyCon_Dual
+std::list<Controller *> controller::OpenDevices() noexcept {
+    std::list<Controller *> controllers;
+    for (auto &info : Enumerate()) {
+        try {
+            controllers.push_back(open_device(category_of(info.product), {info}));
+        } catch (const std::exception &e) {
+            debug("open %s error: %s", info.path.c_str(), e.what());
+        }
+    }
+    return controllers;
+}
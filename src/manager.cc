@@ -0,0 +1,176 @@
+/*
+ *   Copyright (c) 2020 mumumusuc
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "manager.h"
+#include "log.h"
+#include <algorithm>
+
+#define DEBUG 1
+#if DEBUG
+#define debug(fmt, ...) log_d(__func__, fmt, ##__VA_ARGS__)
+#else
+#define debug(fmt, ...)
+#endif
+
+using namespace controller;
+using namespace session;
+using GuardLock = std::lock_guard<std::mutex>;
+
+// ControllerImpl opening its sessions on the manager's reactor
+class ReactorImpl : public ControllerImpl {
+  private:
+    Device device_;
+    Reactor *reactor_;
+
+  protected:
+    Session *OpenDevice(unsigned int, ...) override { return new Session(&device_.func, reactor_, push_type_); };
+
+  public:
+    ReactorImpl(const Device *host, Reactor *reactor) : ControllerImpl(host), device_(*host), reactor_(reactor){};
+};
+
+// bucket n of a Histogram holds [2^(n-1), 2^n) us
+uint64_t controller::Percentile(const Histogram &histogram, unsigned pct) {
+    uint64_t rank = (histogram.count * pct + 99) / 100;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram.buckets[i];
+        if (seen >= rank && seen > 0)
+            return std::min<uint64_t>(i ? (1ull << i) - 1 : 0, histogram.max);
+    }
+    return histogram.max;
+}
+
+ControllerManager::ControllerManager(unsigned io_threads, unsigned workers)
+    : reactor_(io_threads), pool_(workers > 0 ? workers : 1) {}
+
+// controllers go first, their sessions leave the reactor
+ControllerManager::~ControllerManager() {
+    GuardLock lock(lock_);
+    entries_.clear();
+}
+
+size_t ControllerManager::Add(Controller *controller) {
+    GuardLock lock(lock_);
+    entries_.emplace_back(new Entry(controller));
+    return entries_.size() - 1;
+}
+
+Controller *ControllerManager::Add(Category category, const Device &host) {
+    Controller *controller = nullptr;
+    auto impl = new ReactorImpl(&host, &reactor_);
+    switch (category) {
+    case PRO_GRIP:
+        controller = new ProController(impl);
+        break;
+    case JOYCON_L:
+        controller = new JoyCon_L(impl);
+        break;
+    case JOYCON_R:
+        controller = new JoyCon_R(impl);
+        break;
+    case JOYCON:
+        controller = new JoyCon_Dual(impl);
+        break;
+    default:
+        delete impl;
+        throw std::invalid_argument("unknown category");
+    }
+    Add(controller);
+    return controller;
+}
+
+size_t ControllerManager::Size() {
+    GuardLock lock(lock_);
+    return entries_.size();
+}
+
+Controller *ControllerManager::Get(size_t index) {
+    GuardLock lock(lock_);
+    return index < entries_.size() ? entries_[index]->controller.get() : nullptr;
+}
+
+void ControllerManager::GetStats(size_t index, DeviceStats &stats) {
+    GuardLock lock(lock_);
+    if (index >= entries_.size())
+        throw std::out_of_range("no such controller");
+    const Entry &entry = *entries_[index];
+    stats.commands = entry.commands.load(std::memory_order_relaxed);
+    stats.errors = entry.errors.load(std::memory_order_relaxed);
+    entry.latency.Load(stats.latency);
+}
+
+// Latency is timed on the worker, from the start of the command to its end, so it does not
+// count the wait for a free worker. elapsed does.
+// Entries are never removed, so the command runs without lock_ and may call back into the manager.
+RunStats ControllerManager::Run(const Command &command) {
+    RunStats stats = {};
+    std::vector<Entry *> entries;
+    {
+        GuardLock lock(lock_);
+        for (auto &entry : entries_)
+            entries.push_back(entry.get());
+    }
+    std::vector<std::future<uint64_t>> results;
+    std::vector<uint64_t> latencies;
+    results.reserve(entries.size());
+    latencies.reserve(entries.size());
+    uint64_t begin = monotonic_ns();
+    for (Entry *e : entries) {
+        results.emplace_back(pool_.enqueue([e, &command]() -> uint64_t {
+            uint64_t start = monotonic_ns();
+            int ret = command(*e->controller);
+            uint64_t us = (monotonic_ns() - start) / 1000;
+            e->latency.Record(us);
+            e->commands.fetch_add(1, std::memory_order_relaxed);
+            if (ret != DONE)
+                e->errors.fetch_add(1, std::memory_order_relaxed);
+            return ret != DONE ? us | 1ull << 63 : us;
+        }));
+    }
+    for (auto &result : results) {
+        uint64_t us = result.get();
+        if (us >> 63)
+            stats.errors++;
+        latencies.push_back(us & ~(1ull << 63));
+    }
+    stats.elapsed = (monotonic_ns() - begin) / 1000;
+    stats.commands = latencies.size();
+    if (stats.commands > 0) {
+        std::sort(latencies.begin(), latencies.end());
+        stats.p50 = latencies[(stats.commands - 1) * 50 / 100];
+        stats.p99 = latencies[(stats.commands - 1) * 99 / 100];
+        stats.max = latencies.back();
+        stats.throughput = stats.commands * 1e6 / (stats.elapsed > 0 ? stats.elapsed : 1);
+    }
+    debug("%zu commands, %zu errors in %lu us, p50 %lu us, p99 %lu us", stats.commands, stats.errors,
+          stats.elapsed, stats.p50, stats.p99);
+    return stats;
+}
+
+RunStats ControllerManager::SetPlayer(Player player, PlayerFlash flash) {
+    return Run([player, flash](Controller &c) { return c.SetPlayer(player, flash); });
+}
+
+RunStats ControllerManager::SetImu(bool enable) {
+    return Run([enable](Controller &c) { return c.SetImu(enable); });
+}
+
+// BackupMemory returns the size read
+RunStats ControllerManager::BackupMemory() {
+    return Run([](Controller &c) { return c.BackupMemory(nullptr) == FLASH_MEM_SIZE ? DONE : ERROR; });
+}
@@ -0,0 +1,290 @@
+/*
+ *   Copyright (c) 2020 mumumusuc
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "report_decoder.h"
+#include "mcu.h"
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DECODER_X86 1
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define DECODER_X86 0
+#endif
+
+using namespace controller;
+
+// offsets in a report
+#define OFFSET_BUTTON 3
+#define OFFSET_LEFT_STICK 6
+#define OFFSET_RIGHT_STICK 9
+#define OFFSET_IMU 13
+#define IMU_RAW_VALUES 18
+
+static inline uint32_t load32(const uint8_t *src) {
+    uint32_t value;
+    memcpy(&value, src, sizeof(value));
+    return value;
+}
+
+ReportDecoder::ReportDecoder() : kernel_(SCALAR) {
+    StickCalibration nominal;
+    uint8_t blank[FLASH_ADDR_STICK_CALIB_LEN];
+    memset(blank, 0xff, sizeof(blank));
+    nominal.Parse(blank, false);
+    Load(false, nominal);
+    Load(true, nominal);
+    SetImuScale(ACC_SCALE_DEFAULT, GYRO_SCALE_DEFAULT);
+#if DECODER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kernel_ = AVX2;
+    else if (__builtin_cpu_supports("sse2"))
+        kernel_ = SSE2;
+#endif
+}
+
+void ReportDecoder::Load(bool right, const StickCalibration &calibration, uint16_t deadzone) {
+    for (int i = 0; i < 2; ++i) {
+        Axis &axis = axes_[(right ? 2 : 0) + i];
+        axis.center = calibration.center[i];
+        axis.deadzone = deadzone;
+        axis.above = calibration.above[i] > deadzone ? 1.0f / (calibration.above[i] - deadzone) : 0;
+        axis.below = calibration.below[i] > deadzone ? 1.0f / (calibration.below[i] - deadzone) : 0;
+    }
+}
+
+void ReportDecoder::SetImuScale(float acc, float gyro) {
+    for (int i = 0; i < IMU_RAW_VALUES; ++i)
+        imu_scale_[i] = (i / 3) % 2 ? gyro : acc;
+    for (int i = IMU_RAW_VALUES; i < IMU_SCALES; ++i)
+        imu_scale_[i] = 0;
+}
+
+bool ReportDecoder::SetKernel(Kernel kernel) {
+#if DECODER_X86
+    if (kernel == AVX2 && !__builtin_cpu_supports("avx2"))
+        return false;
+    if (kernel == SSE2 && !__builtin_cpu_supports("sse2"))
+        return false;
+#else
+    if (kernel != SCALAR)
+        return false;
+#endif
+    kernel_ = kernel;
+    return true;
+}
+
+void ReportDecoder::Decode(const void *reports, size_t stride, size_t count, const ReportBatch &batch) const {
+    auto base = reinterpret_cast<const uint8_t *>(reports);
+    switch (kernel_) {
+    case AVX2:
+        DecodeAvx2(base, stride, count, batch);
+        break;
+    case SSE2:
+        DecodeSse2(base, stride, count, batch);
+        break;
+    default:
+        DecodeScalar(base, stride, 0, count, batch);
+        break;
+    }
+}
+
+// The kernels below compute each value with the same float operations in the same order,
+// so all of them give the same results.
+
+static inline float decode_axis(float raw, float center, float deadzone, float above, float below) {
+    float d = raw - center;
+    float m = fabsf(d) - deadzone;
+    if (m < 0)
+        m = 0;
+    float s = m * (d > 0 ? above : below);
+    if (s > 1)
+        s = 1;
+    return d > 0 ? s : -s;
+}
+
+// split the imu values of a report into its acc and gyro triplets
+static inline void store_imu(const float *values, size_t i, const ReportBatch &batch) {
+    for (int sample = 0; sample < 3; ++sample) {
+        if (batch.acc)
+            memcpy(batch.acc + i * DECODE_IMU_VALUES + sample * 3, values + sample * 6, 3 * sizeof(float));
+        if (batch.gyro)
+            memcpy(batch.gyro + i * DECODE_IMU_VALUES + sample * 3, values + sample * 6 + 3, 3 * sizeof(float));
+    }
+}
+
+// reports [begin, end)
+void ReportDecoder::DecodeScalar(const uint8_t *base, size_t stride, size_t begin, size_t end,
+                                 const ReportBatch &batch) const {
+    float *sticks[4] = {batch.left_x, batch.left_y, batch.right_x, batch.right_y};
+    for (size_t i = begin; i < end; ++i) {
+        const uint8_t *report = base + i * stride;
+        if (batch.buttons)
+            batch.buttons[i] = load32(report + OFFSET_BUTTON) & 0xffffff;
+        uint32_t left = load32(report + OFFSET_LEFT_STICK);
+        uint32_t right = load32(report + OFFSET_RIGHT_STICK);
+        const uint32_t raw[4] = {left & 0xfff, left >> 12 & 0xfff, right & 0xfff, right >> 12 & 0xfff};
+        for (int a = 0; a < 4; ++a) {
+            if (!sticks[a])
+                continue;
+            const Axis &axis = axes_[a];
+            sticks[a][i] = decode_axis(static_cast<float>(raw[a]), axis.center, axis.deadzone, axis.above, axis.below);
+        }
+        if (batch.acc || batch.gyro) {
+            float values[IMU_RAW_VALUES];
+            for (int v = 0; v < IMU_RAW_VALUES; ++v) {
+                int16_t value;
+                memcpy(&value, report + OFFSET_IMU + v * 2, sizeof(value));
+                values[v] = static_cast<float>(value) * imu_scale_[v];
+            }
+            store_imu(values, i, batch);
+        }
+    }
+}
+
+#if DECODER_X86
+
+TARGET_SSE2 static inline __m128 decode_axis_sse2(__m128 raw, const float *axis) {
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 d = _mm_sub_ps(raw, _mm_set1_ps(axis[0]));
+    __m128 m = _mm_max_ps(_mm_sub_ps(_mm_andnot_ps(sign, d), _mm_set1_ps(axis[1])), _mm_setzero_ps());
+    __m128 positive = _mm_cmpgt_ps(d, _mm_setzero_ps());
+    __m128 scale = _mm_or_ps(_mm_and_ps(positive, _mm_set1_ps(axis[2])), _mm_andnot_ps(positive, _mm_set1_ps(axis[3])));
+    __m128 s = _mm_min_ps(_mm_mul_ps(m, scale), _mm_set1_ps(1.0f));
+    return _mm_or_ps(_mm_and_ps(positive, s), _mm_andnot_ps(positive, _mm_xor_ps(s, sign)));
+}
+
+// sign extended int16 to float
+TARGET_SSE2 static inline void convert_sse2(__m128i v, float *dst, const float *scale) {
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+    _mm_storeu_ps(dst, _mm_mul_ps(_mm_cvtepi32_ps(lo), _mm_loadu_ps(scale)));
+    _mm_storeu_ps(dst + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), _mm_loadu_ps(scale + 4)));
+}
+
+// four reports at a time, the sticks of each report are gathered into one lane
+TARGET_SSE2 void ReportDecoder::DecodeSse2(const uint8_t *base, size_t stride, size_t count,
+                                           const ReportBatch &batch) const {
+    const __m128i mask12 = _mm_set1_epi32(0xfff);
+    float *sticks[4] = {batch.left_x, batch.left_y, batch.right_x, batch.right_y};
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const uint8_t *r = base + i * stride;
+        if (batch.buttons) {
+            __m128i buttons = _mm_set_epi32(load32(r + 3 * stride + OFFSET_BUTTON), load32(r + 2 * stride + OFFSET_BUTTON),
+                                            load32(r + stride + OFFSET_BUTTON), load32(r + OFFSET_BUTTON));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(batch.buttons + i),
+                             _mm_and_si128(buttons, _mm_set1_epi32(0xffffff)));
+        }
+        for (int side = 0; side < 2; ++side) {
+            size_t offset = side ? OFFSET_RIGHT_STICK : OFFSET_LEFT_STICK;
+            __m128i packed = _mm_set_epi32(load32(r + 3 * stride + offset), load32(r + 2 * stride + offset),
+                                           load32(r + stride + offset), load32(r + offset));
+            __m128 x = _mm_cvtepi32_ps(_mm_and_si128(packed, mask12));
+            __m128 y = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(packed, 12), mask12));
+            if (sticks[side * 2])
+                _mm_storeu_ps(sticks[side * 2] + i, decode_axis_sse2(x, &axes_[side * 2].center));
+            if (sticks[side * 2 + 1])
+                _mm_storeu_ps(sticks[side * 2 + 1] + i, decode_axis_sse2(y, &axes_[side * 2 + 1].center));
+        }
+        if (batch.acc || batch.gyro) {
+            for (size_t j = 0; j < 4; ++j) {
+                const uint8_t *imu = r + j * stride + OFFSET_IMU;
+                float values[IMU_SCALES];
+                convert_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(imu)), values, imu_scale_);
+                convert_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(imu + 16)), values + 8, imu_scale_ + 8);
+                convert_sse2(_mm_cvtsi32_si128(load32(imu + 32)), values + 16, imu_scale_ + 16);
+                store_imu(values, i + j, batch);
+            }
+        }
+    }
+    DecodeScalar(base, stride, i, count, batch);
+}
+
+TARGET_AVX2 static inline __m256 decode_axis_avx2(__m256 raw, const float *axis) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 d = _mm256_sub_ps(raw, _mm256_set1_ps(axis[0]));
+    __m256 m = _mm256_max_ps(_mm256_sub_ps(_mm256_andnot_ps(sign, d), _mm256_set1_ps(axis[1])), _mm256_setzero_ps());
+    __m256 positive = _mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_GT_OQ);
+    __m256 scale = _mm256_blendv_ps(_mm256_set1_ps(axis[3]), _mm256_set1_ps(axis[2]), positive);
+    __m256 s = _mm256_min_ps(_mm256_mul_ps(m, scale), _mm256_set1_ps(1.0f));
+    return _mm256_blendv_ps(_mm256_xor_ps(s, sign), s, positive);
+}
+
+TARGET_AVX2 static inline __m256i gather_avx2(const uint8_t *r, size_t stride, size_t offset) {
+    const __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                             _mm256_set1_epi32(static_cast<int>(stride)));
+    return _mm256_i32gather_epi32(reinterpret_cast<const int *>(r + offset), index, 1);
+}
+
+// eight reports at a time with gathered loads, reports up to 256 MB apart fit the 32 bit index
+TARGET_AVX2 void ReportDecoder::DecodeAvx2(const uint8_t *base, size_t stride, size_t count,
+                                           const ReportBatch &batch) const {
+    const __m256i mask12 = _mm256_set1_epi32(0xfff);
+    float *sticks[4] = {batch.left_x, batch.left_y, batch.right_x, batch.right_y};
+    size_t i = 0;
+    if (stride > (1u << 28))
+        return DecodeSse2(base, stride, count, batch);
+    for (; i + 8 <= count; i += 8) {
+        const uint8_t *r = base + i * stride;
+        if (batch.buttons)
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(batch.buttons + i),
+                                _mm256_and_si256(gather_avx2(r, stride, OFFSET_BUTTON), _mm256_set1_epi32(0xffffff)));
+        for (int side = 0; side < 2; ++side) {
+            __m256i packed = gather_avx2(r, stride, side ? OFFSET_RIGHT_STICK : OFFSET_LEFT_STICK);
+            __m256 x = _mm256_cvtepi32_ps(_mm256_and_si256(packed, mask12));
+            __m256 y = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(packed, 12), mask12));
+            if (sticks[side * 2])
+                _mm256_storeu_ps(sticks[side * 2] + i, decode_axis_avx2(x, &axes_[side * 2].center));
+            if (sticks[side * 2 + 1])
+                _mm256_storeu_ps(sticks[side * 2 + 1] + i, decode_axis_avx2(y, &axes_[side * 2 + 1].center));
+        }
+        if (batch.acc || batch.gyro) {
+            for (size_t j = 0; j < 8; ++j) {
+                const uint8_t *imu = r + j * stride + OFFSET_IMU;
+                float values[IMU_SCALES];
+                __m256i lo = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(imu)));
+                __m256i hi = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(imu + 16)));
+                _mm256_storeu_ps(values, _mm256_mul_ps(_mm256_cvtepi32_ps(lo), _mm256_loadu_ps(imu_scale_)));
+                _mm256_storeu_ps(values + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(hi), _mm256_loadu_ps(imu_scale_ + 8)));
+                for (int v = 16; v < IMU_RAW_VALUES; ++v) {
+                    int16_t value;
+                    memcpy(&value, imu + v * 2, sizeof(value));
+                    values[v] = static_cast<float>(value) * imu_scale_[v];
+                }
+                store_imu(values, i + j, batch);
+            }
+        }
+    }
+    DecodeScalar(base, stride, i, count, batch);
+}
+
+#else
+
+void ReportDecoder::DecodeSse2(const uint8_t *base, size_t stride, size_t count, const ReportBatch &batch) const {
+    DecodeScalar(base, stride, 0, count, batch);
+}
+
+void ReportDecoder::DecodeAvx2(const uint8_t *base, size_t stride, size_t count, const ReportBatch &batch) const {
+    DecodeScalar(base, stride, 0, count, batch);
+}
+
+#endif // DECODER_X86
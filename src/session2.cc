@@ -19,10 +19,11 @@
 #include "log.h"
 #include <assert.h>
 #include <errno.h>
-
-#ifdef __android__
-#include <signal.h>
-#endif
+#include <algorithm>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #define DEBUG 1
 #if DEBUG
@@ -33,75 +34,71 @@
 
 using namespace session;
 
-static uint8_t _timer;
-#define TIMER                                     \
-    ({                                            \
-        _timer = _timer > 0xfe ? 0 : _timer += 1; \
-        _timer;                                   \
-    })
-#define msleep(ms) std::this_thread::sleep_for(std::chrono::milliseconds((ms)))
-
-inline Semaphore::Semaphore(unsigned count) {
-    sem_init(&sem_, 0, count);
-}
-
-inline Semaphore::~Semaphore() {
-    sem_destroy(&sem_);
-}
+// timer byte of input and output reports
+#define REPORT_TIMER 1
+// layout of output reports merged by TIMED push
+#define REPORT_RUMBLE_ONLY 0x10
+#define REPORT_RUMBLE 2
+#define RUMBLE_SIZE 8
+// the subcmd setting the input report mode
+#define REPORT_SUBCMD 0x01
+#define REPORT_SUBCMD_ID 10
+#define REPORT_MODE 11
+#define SUBCMD_SET_MODE 0x03
+#define MODE_NFC_IR 0x31
+// report bytes up to the end of controller_data
+#define REPORT_STATE_SIZE 12
+#define REPORT_BUTTON 3
+static const uint8_t RUMBLE_NEUTRAL[RUMBLE_SIZE] = {0x00, 0x01, 0x40, 0x40, 0x00, 0x01, 0x40, 0x40};
 
-inline void Semaphore::Wait() {
-    int ret = sem_wait(&sem_);
-    assert(ret == 0);
-}
+inline Task::Task(TaskPool *pool)
+    : timeout_(0), start_(0), deadline_(0), inspector_(nullptr), state_(DONE), waiters_(0), refs_(0),
+      pool_(pool), route_link_({nullptr, nullptr}), wheel_link_({nullptr, nullptr}), wheel_slot_(0){};
 
-inline bool Semaphore::TryWait() {
-    int ret = sem_trywait(&sem_);
-    if (ret == EAGAIN) return false;
-    assert(ret == 0);
-    return true;
+// Called with the task freshly taken from pool, one reference for the session and one for
+// the Future. Timeout is in ms.
+inline void Task::Reset(unsigned int timeout, const Route &route, const Inspector &cb) {
+    timeout_ = timeout * 1000000ull;
+    route_ = route;
+    inspector_ = cb;
+    state_.store(WAITING, std::memory_order_relaxed);
+    refs_.store(2, std::memory_order_relaxed);
 }
 
-inline void Semaphore::Post() {
-    int ret = sem_post(&sem_);
-    assert(ret == 0);
-}
+inline void Task::Arm(uint64_t now) { deadline_.store(now + timeout_, std::memory_order_relaxed); }
 
-inline bool Semaphore::Valid() {
-    int value = 0;
-    int ret = sem_getvalue(&sem_, &value);
-    assert(ret == 0);
-    return value > 0;
+inline void Task::Complete(Result result) {
+    int expected = WAITING;
+    if (!state_.compare_exchange_strong(expected, result))
+        return;
+    if (waiters_.load() > 0)
+        futex_wake(&state_, INT32_MAX);
 }
 
-inline Task::Task() : retry_(0), inspector_(nullptr){};
+inline void Task::Done() { Complete(DONE); }
 
-inline std::future<Result> Task::Reset(unsigned int retry, const Inspector &cb) {
-    promise_ = std::promise<Result>();
-    retry_ = retry;
-    inspector_ = cb;
-    return promise_.get_future();
-}
+inline void Task::Abort() { Complete(ABORT); };
 
-inline void Task::Done() { promise_.set_value(DONE); }
+inline void Task::Error() { Complete(ERROR); };
 
-inline void Task::Abort() { promise_.set_value(ABORT); };
+inline void Task::Timeout() { Complete(TIMEDOUT); };
 
-inline void Task::Error() { promise_.set_value(ERROR); };
-
-inline bool Task::Test(const void *buffer) {
+inline bool Task::Test(const void *buffer, uint64_t now) {
     int ret = 0;
-    if (retry_-- < 1) {
-        promise_.set_value(TIMEDOUT);
+    if (state_.load(std::memory_order_relaxed) != WAITING) /* completed elsewhere */
+        return true;
+    if (Expired(now)) {
+        Timeout();
         return true;
     }
     if (!inspector_) /* no one cares */
         return true;
     switch (ret = inspector_(buffer)) {
     case DONE:
-        promise_.set_value(DONE);
+        Done();
         return true;
     case AGAIN:
-        retry_++;
+        Arm(now);
         return false;
     case WAITING:
         return false;
@@ -111,47 +108,260 @@ inline bool Task::Test(const void *buffer) {
     }
 }
 
-inline TaskPool::TaskPool() : exported_(0) {}
+inline Result Task::Wait() {
+    int state = state_.load(std::memory_order_acquire);
+    if (state == WAITING) {
+        waiters_.fetch_add(1);
+        // the deadline is also kept here, so a silent device cannot hold the waiter
+        while ((state = state_.load()) == WAITING) {
+            uint64_t now = monotonic_ns();
+            uint64_t deadline = this->deadline();
+            if (now >= deadline) {
+                Timeout();
+                continue;
+            }
+            struct timespec timeout = {
+                .tv_sec = static_cast<time_t>((deadline - now) / 1000000000ull),
+                .tv_nsec = static_cast<long>((deadline - now) % 1000000000ull),
+            };
+            futex_wait(&state_, WAITING, &timeout);
+        }
+        waiters_.fetch_sub(1);
+    }
+    return Result(state);
+}
+
+inline void Task::Release() {
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        inspector_ = nullptr;
+        pool_->Put(this);
+    }
+}
+
+Future &Future::operator=(Future &&other) {
+    if (this != &other) {
+        if (task_)
+            task_->Release();
+        task_ = other.task_;
+        other.task_ = nullptr;
+    }
+    return *this;
+}
+
+Future::~Future() {
+    if (task_)
+        task_->Release();
+}
+
+Result Future::Get() {
+    assert(task_);
+    Result result = task_->Wait();
+    task_->Release();
+    task_ = nullptr;
+    return result;
+}
+
+ReportRing::ReportRing(size_t stride) : stride_(stride), head_(0) {
+    slots_ = new Slot[RING_SLOTS]();
+    data_ = reinterpret_cast<uint8_t *>(calloc(RING_SLOTS, stride_));
+    if (data_ == NULL) {
+        delete[] slots_;
+        throw std::runtime_error(strerror(ENOMEM));
+    }
+}
+
+ReportRing::~ReportRing() {
+    delete[] slots_;
+    free(data_);
+}
+
+// Producer only. Returns the buffer of the next slot, marking it as being written.
+inline void *ReportRing::Acquire() {
+    size_t count = 1;
+    return Acquire(count);
+}
+
+// Producer only. Returns the buffer of the next `count` slots, marking them as being
+// written. count is cut to the slots left before the ring wraps, they are contiguous.
+inline void *ReportRing::Acquire(size_t &count) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    size_t index = head & (RING_SLOTS - 1);
+    if (count > RING_SLOTS - index)
+        count = RING_SLOTS - index;
+    for (size_t i = 0; i < count; ++i)
+        slots_[index + i].seq.store(2 * (head + i) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return data_ + index * stride_;
+}
+
+// Producer only. Publishes the acquired slot, returns its sequence number.
+inline uint64_t ReportRing::Publish(size_t size, uint64_t time) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    Slot &slot = slots_[head & (RING_SLOTS - 1)];
+    slot.size = size;
+    slot.time = time;
+    slot.seq.store(2 * head + 2, std::memory_order_release);
+    head_.store(head + 1, std::memory_order_release);
+    return head;
+}
+
+ssize_t ReportRing::Read(uint64_t seq, void *buffer, size_t size, uint64_t *time) const {
+    size_t index = seq & (RING_SLOTS - 1);
+    const Slot &slot = slots_[index];
+    uint64_t begin = slot.seq.load(std::memory_order_acquire);
+    if (begin < 2 * seq + 2)
+        return -EAGAIN;
+    if (begin != 2 * seq + 2)
+        return -EOVERFLOW;
+    size_t n = size < slot.size ? size : slot.size;
+    uint64_t t = slot.time;
+    memcpy(buffer, data_ + index * stride_, n);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) != begin)
+        return -EOVERFLOW;
+    if (time)
+        *time = t;
+    return n;
+}
+
+SendQueue::SendQueue(size_t stride) : stride_(stride), head_(0), tail_(0) {
+    data_ = reinterpret_cast<uint8_t *>(calloc(SEND_QUEUE_SLOTS, stride_));
+    if (data_ == NULL)
+        throw std::runtime_error(strerror(ENOMEM));
+}
+
+SendQueue::~SendQueue() {
+    free(data_);
+}
+
+// Producer only. Returns the slot to fill, nullptr if the queue is full.
+inline void *SendQueue::Reserve() {
+    unsigned head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == SEND_QUEUE_SLOTS)
+        return nullptr;
+    return data_ + (head & (SEND_QUEUE_SLOTS - 1)) * stride_;
+}
+
+// Producer only. Publishes the reserved slot.
+inline void SendQueue::Commit() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// Consumer only. Returns the oldest report, nullptr if the queue is empty.
+inline void *SendQueue::Front() {
+    unsigned tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire))
+        return nullptr;
+    return data_ + (tail & (SEND_QUEUE_SLOTS - 1)) * stride_;
+}
+
+// Consumer only. Frees the slot returned by Front().
+inline void SendQueue::Pop() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// Tasks are released by the poll thread right after waking their waiter, so a caller
+// issuing commands back to back may find the previous task still in use. Keep a few
+// spare tasks from the start so steady state never allocates.
+inline TaskPool::TaskPool() : exported_(0), orphaned_(false), free_(nullptr) {
+    for (unsigned i = 0; i < TASK_POOL_RESERVE; ++i) {
+        Task *t = new Task(this);
+        t->route_link_.next = free_;
+        free_ = t;
+    }
+}
 
 inline TaskPool::~TaskPool() {
     std::lock_guard<std::mutex> _1(lock_);
     assert(exported_ == 0);
-    size_t size = pool_.size();
-    while (!pool_.empty()) {
-        Task *t = pool_.front();
-        pool_.pop();
+    while (free_) {
+        Task *t = free_;
+        free_ = t->route_link_.next;
         delete t;
     }
 }
 
-inline TaskSp TaskPool::Get() {
+inline Task *TaskPool::Get() {
     Task *p = nullptr;
     std::lock_guard<std::mutex> _1(lock_);
-    if (pool_.empty()) {
-        p = new Task();
+    if (free_ == nullptr) {
+        p = new Task(this);
     } else {
-        p = pool_.front();
-        pool_.pop();
+        p = free_;
+        free_ = p->route_link_.next;
+        p->route_link_.next = nullptr;
     }
     exported_++;
-    auto deleter = [this](Task *t) {
+    return p;
+}
+
+inline void TaskPool::Put(Task *task) {
+    bool last = false;
+    {
         std::lock_guard<std::mutex> _1(lock_);
-        pool_.emplace(t);
+        task->route_link_.next = free_;
+        free_ = task;
         exported_--;
-    };
-    return TaskSp(p, deleter);
+        last = orphaned_ && exported_ == 0;
+    }
+    if (last)
+        delete this;
 }
 
-Session::Session(const DeviceFunc *remote)
-    : is_alive_(true), err_count_(0), poll_running_(false), push_running_(false), push_type_(FREE), push_sem_(1) {
+// The owner is gone, the pool is deleted now or by the Put of its last exported task.
+inline void TaskPool::Orphan() {
+    bool last = false;
+    {
+        std::lock_guard<std::mutex> _1(lock_);
+        orphaned_ = true;
+        last = exported_ == 0;
+    }
+    if (last)
+        delete this;
+}
+
+Session::Session(const DeviceFunc *remote, PushType type, unsigned period) : Session(remote, nullptr, type, period) {}
+
+Session::Session(const DeviceFunc *remote, Reactor *reactor, PushType type, unsigned period)
+    : is_alive_(true), link_state_(LINK_HEALTHY), err_count_(0), link_good_(0), link_backoff_(0), resume_(0), recv_size_(0), large_buffer_(nullptr), send_buffer_(nullptr), route_mask_(0), wheel_tick_(0), armed_(0),
+      task_pool_(nullptr), poll_running_(false), push_running_(false), push_type_(type),
+      push_period_(period * 1000000ull), push_queue_(nullptr), push_head_(0), push_tail_(0), push_stats_(),
+      push_period_sum_(0), push_late_sum_(0), push_timer_(-1), push_deadline_(0), push_last_(0),
+      stop_fd_(-1), wake_fd_(-1), state_lock_(0), state_wake_(0), state_waiters_(0), state_(), timer_last_(0),
+      timer_recv_(0), timer_step_(0), timer_offset_(0), send_timer_(0), buttons_(0), button_events_(), button_head_(0),
+      button_tail_(0), button_dropped_(0), reactor_(nullptr), reactor_id_(0) {
     int ret = 0;
     debug("create session");
+    if (type == TIMED && period == 0)
+        throw std::invalid_argument("push period must not be 0");
+    if (remote && remote->send_size > SEND_SIZE_MAX)
+        throw std::invalid_argument("send size is over SEND_SIZE_MAX");
+    memcpy(rumble_, RUMBLE_NEUTRAL, RUMBLE_SIZE);
+    stop_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stop_fd_ < 0 || wake_fd_ < 0) {
+        ret = errno;
+        goto error;
+    }
+    task_pool_ = new TaskPool();
     if (remote) {
         remote_ = *const_cast<DeviceFunc *>(remote);
-        if (remote_.recver) {
-            recv_buffer_ = calloc(1, remote_.recv_size);
-            if (recv_buffer_ == NULL)
-                throw std::runtime_error(strerror(ENOMEM));
+        // a reactor only waits on fds, a recver without one keeps its poll thread
+        if (reactor && !remote_.pollable)
+            reactor = nullptr;
+        // a device without recver may still have its reports fed
+        if (remote_.recver || remote_.batch_recver || remote_.recv_size > 0) {
+            ring_ = std::unique_ptr<ReportRing>(new ReportRing(remote_.recv_size));
+            recv_size_ = remote_.recv_size;
+            if (remote_.recv_size < RECV_LARGE_SIZE) {
+                large_buffer_ = calloc(1, RECV_LARGE_SIZE);
+                if (large_buffer_ == NULL) {
+                    ret = ENOMEM;
+                    goto error;
+                }
+            }
+        }
+        if (ring_ && !reactor && (remote_.recver || remote_.batch_recver)) {
             // start poll thread
             auto poll = [](void *arg) -> void * {
                 assert(arg);
@@ -160,15 +370,33 @@ Session::Session(const DeviceFunc *remote)
             };
             ret = pthread_create(&tr_poll_, NULL, std::move(poll), this);
             assert(ret == 0);
+            poll_running_ = true;
         }
         if (remote_.sender) {
             send_buffer_ = calloc(1, remote_.send_size);
             if (send_buffer_ == NULL) {
-                free(recv_buffer_);
-                throw std::runtime_error(strerror(ENOMEM));
+                ret = ENOMEM;
+                goto error;
             }
             // start push thread
             if (push_type_ == TIMED) {
+                push_queue_ = reinterpret_cast<uint8_t *>(calloc(PUSH_QUEUE_SLOTS, remote_.send_size));
+                if (push_queue_ == NULL) {
+                    ret = ENOMEM;
+                    goto error;
+                }
+                ret = StartPush();
+                if (ret != 0)
+                    goto error;
+            } else if (push_type_ == QUEUED) {
+                send_queue_ = std::unique_ptr<SendQueue>(new SendQueue(remote_.send_size));
+                push_timer_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+                if (push_timer_ < 0) {
+                    ret = errno;
+                    goto error;
+                }
+            }
+            if (push_type_ != FREE && !reactor) {
                 auto push = [](void *arg) -> void * {
                     assert(arg);
                     auto sess = reinterpret_cast<Session *>(arg);
@@ -176,196 +404,1080 @@ Session::Session(const DeviceFunc *remote)
                 };
                 ret = pthread_create(&tr_push_, NULL, std::move(push), this);
                 assert(ret == 0);
+                push_running_ = true;
             }
         }
+        if (reactor)
+            reactor->Add(this);
     }
+    return;
+
+error:
+    // the destructor does not run for a throwing constructor
+    Stop();
+    free(push_queue_);
+    free(send_buffer_);
+    free(large_buffer_);
+    throw std::runtime_error(strerror(ret));
 }
 
-Session::~Session() {
-    debug("destroy session");
+// Wake every wait of the session threads and join them. Neither thread is cancelled, they
+// leave their loops at the next wakeup, a recver without poll_fd is woken by the waker hook.
+void Session::Stop() {
     int ret = 0;
+    uint64_t one = 1;
     is_alive_ = false;
-    if (poll_running_) {
-#ifdef __android__
-        ret = pthread_kill(tr_poll_, SIGQUIT);
-        assert(ret == 0);
-#else
-        ret = pthread_cancel(tr_poll_);
-        assert(ret == 0);
-#endif
-        debug("cancel poll thread done");
-    }
-    if (push_running_) {
-#ifdef __android__
-        ret = pthread_kill(tr_push_, SIGQUIT);
-        assert(ret == 0);
-#else
-        ret = pthread_cancel(tr_push_);
-        assert(ret == 0);
-#endif
-        debug("cancel push thread done");
+    // a state waiter checking is_alive_ before sleeping finds the futex word changed
+    state_wake_.fetch_add(1);
+    futex_wake(&state_wake_, INT32_MAX);
+    if (stop_fd_ >= 0) {
+        ret = write(stop_fd_, &one, sizeof(one));
+        assert(ret == sizeof(one));
     }
+    if (remote_.waker)
+        remote_.waker();
+    if (reactor_)
+        reactor_->Remove(this);
     if (poll_running_) {
         ret = pthread_join(tr_poll_, nullptr);
         assert(ret == 0);
+        poll_running_ = false;
         debug("join poll thread done");
     }
     if (push_running_) {
         ret = pthread_join(tr_push_, nullptr);
         assert(ret == 0);
+        push_running_ = false;
         debug("join push thread done");
     }
-    // clean task queue
-    if (!task_queue_.empty()) {
-        auto it = task_queue_.cbegin();
-        while (it != task_queue_.cend()) {
-            auto spp = it++;
-            (*spp)->Abort();
-            task_queue_.erase(spp);
-        }
+    // abort the tasks left, their Futures may outlive the session and keep the pool
+    if (task_pool_) {
+        Fail(ABORT);
+        task_pool_->Orphan();
+        task_pool_ = nullptr;
     }
-    free(recv_buffer_);
+    if (stop_fd_ >= 0)
+        close(stop_fd_);
+    if (wake_fd_ >= 0)
+        close(wake_fd_);
+    if (push_timer_ >= 0)
+        close(push_timer_);
+    stop_fd_ = wake_fd_ = push_timer_ = -1;
+}
+
+Session::~Session() {
+    debug("destroy session");
+    Stop();
+    free(push_queue_);
     free(send_buffer_);
+    free(large_buffer_);
     debug("destroy session done");
 }
 
-inline ssize_t Session::Send(const void *buffer) {
+// Sleep for ms unless the session stops.
+inline void Session::Doze(int ms) {
+    if (ms <= 0)
+        return;
+    struct pollfd fd = {.fd = stop_fd_, .events = POLLIN, .revents = 0};
+    poll(&fd, 1, ms);
+}
+
+// Back off ms after an I/O error. The loop of a reactor serves other sessions too and must not
+// sleep, the session sits out of it until resume_ instead.
+inline void Session::Backoff(int ms) {
+    if (!reactor_)
+        Doze(ms);
+    else if (ms > 0)
+        resume_ = monotonic_ns() + ms * 1000000ull;
+}
+
+// Judge the link by a received report (ok) or an I/O error, returns the ms the I/O thread
+// should back off. Only received reports count as health, a device may take writes and
+// never answer. Entering LINK_LOST fails the pending tasks.
+int Session::Link(bool ok) {
+    // a healthy link with no error left to decay
+    if (ok && link_state_.load(std::memory_order_relaxed) == LINK_HEALTHY &&
+        err_count_.load(std::memory_order_relaxed) == 0)
+        return 0;
+    LinkCallback callback;
+    int backoff = 0;
+    LinkState from, to;
+    {
+        std::lock_guard<std::mutex> _1(link_lock_);
+        from = to = static_cast<LinkState>(link_state_.load(std::memory_order_relaxed));
+        int score = err_count_.load(std::memory_order_relaxed);
+        if (ok) {
+            score = score > 0 ? score - 1 : 0;
+            link_backoff_ = 0;
+            if (from == LINK_LOST) {
+                to = LINK_RECOVERING;
+                link_good_ = 1;
+            } else if (from == LINK_RECOVERING && ++link_good_ >= LINK_RECOVER_REPORTS) {
+                to = LINK_HEALTHY;
+                score = 0;
+            } else if (from == LINK_DEGRADED && score == 0) {
+                to = LINK_HEALTHY;
+            }
+        } else {
+            score = score < LINK_LOST_ERRORS ? score + 1 : LINK_LOST_ERRORS;
+            link_good_ = 0;
+            if (from == LINK_RECOVERING || (from != LINK_LOST && score >= LINK_LOST_ERRORS))
+                to = LINK_LOST;
+            else if (from == LINK_HEALTHY && score >= LINK_DEGRADED_ERRORS)
+                to = LINK_DEGRADED;
+            if (to == LINK_LOST) {
+                link_backoff_ = link_backoff_ ? link_backoff_ * 2 : LINK_BACKOFF_MIN_MS;
+                if (link_backoff_ > LINK_BACKOFF_MAX_MS)
+                    link_backoff_ = LINK_BACKOFF_MAX_MS;
+                backoff = link_backoff_;
+            }
+        }
+        err_count_.store(score, std::memory_order_relaxed);
+        link_state_.store(to, std::memory_order_relaxed);
+        if (to != from)
+            callback = link_callback_;
+    }
+    if (to != from) {
+        debug("link %d -> %d", from, to);
+        if (to == LINK_LOST)
+            Fail(LOST);
+        if (callback)
+            callback(from, to);
+    }
+    return backoff;
+}
+
+// complete every pending task with result
+void Session::Fail(Result result) {
+    std::lock_guard<std::mutex> _1(task_lock_);
+    for (unsigned slot = 0; slot < ROUTE_SLOTS; ++slot) {
+        while (!task_table_[slot].Empty()) {
+            Task *task = task_table_[slot].Front();
+            task->Complete(result);
+            Remove(task);
+        }
+    }
+}
+
+void Session::SetLinkCallback(const LinkCallback &callback) {
+    std::lock_guard<std::mutex> _1(link_lock_);
+    link_callback_ = callback;
+}
+
+// Switch the receive size before the report mode changes, so no large report is cut.
+inline void Session::SetMode(uint8_t mode) {
+    if (!large_buffer_)
+        return;
+    recv_size_.store(mode == MODE_NFC_IR ? RECV_LARGE_SIZE : remote_.recv_size, std::memory_order_relaxed);
+}
+
+// Send a report held by the session, the send buffer or a queue slot, stamped with the timer
+// in place.
+inline ssize_t Session::Send(void *buffer) {
     int ret = 0;
     if (remote_.sender) {
-        reinterpret_cast<uint8_t *>(const_cast<void *>(buffer))[1] = TIMER;
+        auto report = reinterpret_cast<uint8_t *>(buffer);
+        if (report[0] == REPORT_SUBCMD && report[REPORT_SUBCMD_ID] == SUBCMD_SET_MODE && remote_.send_size > REPORT_MODE)
+            SetMode(report[REPORT_MODE]);
+        report[REPORT_TIMER] = send_timer_.fetch_add(1, std::memory_order_relaxed) + 1;
         //hex_d("SEND", buffer, remote_.send_size);
         ret = remote_.sender(buffer, remote_.send_size);
         //debug("client send -> %ld", ret);
+        if (ret < 0)
+            counters_.send_errors.fetch_add(1, std::memory_order_relaxed);
+        else
+            counters_.sent.fetch_add(1, std::memory_order_relaxed);
         return ret;
     }
     return -1;
 }
 
-inline ssize_t Session::Recv(void *buffer) {
+// Send a report of the caller through a copy, the caller's buffer is left untouched.
+inline ssize_t Session::SendCopy(const void *buffer) {
+    uint8_t report[SEND_SIZE_MAX];
+    memcpy(report, buffer, remote_.send_size);
+    return Send(report);
+}
+
+inline ssize_t Session::Recv(void *buffer, size_t size) {
     if (remote_.recver) {
-        //hex_d("RECV", buffer, remote_.recv_size);
-        return remote_.recver(buffer, remote_.recv_size);
+        //hex_d("RECV", buffer, size);
+        return remote_.recver(buffer, size);
+    }
+    if (remote_.batch_recver) {
+        size_t got = 0;
+        ssize_t ret = remote_.batch_recver(buffer, size, 1, &got);
+        return ret > 0 ? got : ret;
     }
     return -1;
 }
 
 void *Session::Poll() {
-    poll_running_ = true;
     int ret = 0;
-#ifdef __android__
-    signal(SIGQUIT, [](int signo) {
-        pthread_exit(nullptr);
-    });
-#else
-    ret = pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-    assert(ret == 0);
-    ret = pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
-    assert(ret == 0);
-#endif
+    uint64_t count = 0;
+    struct pollfd fds[3] = {
+        {.fd = remote_.poll_fd, .events = POLLIN, .revents = 0},
+        {.fd = stop_fd_, .events = POLLIN, .revents = 0},
+        {.fd = wake_fd_, .events = POLLIN, .revents = 0},
+    };
     debug("enter poll thread ...");
     while (is_alive_) {
-        ret = Recv(recv_buffer_);
-        if (ret < 0) {
-            err_count_++;
-            debug("recv error %d, err_count %d", ret, err_count_);
-            if (err_count_ > 100) {
-                debug("over 100 times error occurred, dozing...");
-                msleep(100);
+        if (remote_.pollable) {
+            // wait for a report or the stop, and for the next tick while tasks are pending
+            int timeout = armed_.load(std::memory_order_relaxed) ? WHEEL_TICK / 1000000 : -1;
+            ret = poll(fds, 3, timeout);
+            if (ret < 0 && errno != EINTR) {
+                debug("poll error %d", errno);
+                Doze(100);
+                continue;
             }
-        } else {
-            std::lock_guard<std::mutex> _1(task_lock_);
-            if (task_queue_.empty()) continue;
-            auto it = task_queue_.cbegin();
-            while (it != task_queue_.cend()) {
-                auto spp = it++;
-                if ((*spp)->Test(recv_buffer_))
-                    task_queue_.erase(spp);
+            if (fds[1].revents)
+                break;
+            if (fds[2].revents)
+                ret = read(wake_fd_, &count, sizeof(count));
+            if (!fds[0].revents) {
+                Expire(monotonic_ns());
+                continue;
             }
         }
+        if (remote_.batch_recver)
+            PollBatch();
+        else
+            PollOnce();
     }
     debug("exit poll thread ...");
-    poll_running_ = false;
-    pthread_exit(NULL);
     return NULL;
 }
 
+// One poll loop with the recver.
+inline void Session::PollOnce() {
+    size_t size = recv_size_.load(std::memory_order_relaxed);
+    void *buffer = size > remote_.recv_size ? large_buffer_ : ring_->Acquire();
+    ssize_t ret = Recv(buffer, size);
+    uint64_t now = monotonic_ns();
+    if (ret < 0) {
+        counters_.recv_errors.fetch_add(1, std::memory_order_relaxed);
+        debug("recv error %ld, err_count %d", ret, err_count_.load());
+        Backoff(Link(false));
+    } else if (ret > 0) {
+        Link(true);
+        Deliver(buffer, ret, now);
+    }
+    Expire(now);
+}
+
+// Publish and dispatch one report written to the slot given by ring_->Acquire(), or to
+// large_buffer_ whose head is copied to the ring.
+inline void Session::Deliver(void *buffer, size_t size, uint64_t now) {
+    counters_.received.fetch_add(1, std::memory_order_relaxed);
+    counters_.reports[*reinterpret_cast<uint8_t *>(buffer)].fetch_add(1, std::memory_order_relaxed);
+    if (buffer == large_buffer_) {
+        size_t head = size < remote_.recv_size ? size : remote_.recv_size;
+        memcpy(ring_->Acquire(), buffer, head);
+        ring_->Publish(head, now);
+    } else {
+        ring_->Publish(size, now);
+    }
+    Decode(reinterpret_cast<const uint8_t *>(buffer), size, now);
+    Dispatch(buffer, 1, now);
+}
+
+// Write the controller state of a report to state_, then wake its waiters. Poll thread only.
+inline void Session::Decode(const uint8_t *report, size_t size, uint64_t now) {
+    auto input = reinterpret_cast<const InputReport *>(report);
+    if (size < REPORT_STATE_SIZE || (input->id != 0x21 && input->id != 0x30 && input->id != 0x31))
+        return;
+    int lock = state_lock_.load(std::memory_order_relaxed);
+    state_lock_.store(lock + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    state_.seq++;
+    state_.time = now;
+    Stamp(report[REPORT_TIMER], now);
+    state_.controller_state = input->controller_state;
+    state_.controller_data = input->controller_data;
+    state_lock_.store(lock + 2);
+    if (state_waiters_.load() > 0) {
+        state_wake_.fetch_add(1);
+        futex_wake(&state_wake_, INT32_MAX);
+    }
+    // edges are the changed bits, pressed ones set now and released ones set before
+    uint32_t buttons = report[REPORT_BUTTON] | report[REPORT_BUTTON + 1] << 8 | report[REPORT_BUTTON + 2] << 16;
+    uint32_t changed = buttons ^ buttons_;
+    buttons_ = buttons;
+    if (changed == 0)
+        return;
+    uint64_t head = button_head_.load(std::memory_order_relaxed);
+    if (head - button_tail_.load(std::memory_order_acquire) == BUTTON_EVENT_SLOTS) {
+        button_dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    button_events_[head & (BUTTON_EVENT_SLOTS - 1)] = {state_.timestamp, changed & buttons, changed & ~buttons};
+    button_head_.store(head + 1, std::memory_order_release);
+}
+
+// Unwrap the timer byte of a report into state_.ticks and state_.timestamp, counting the reports
+// lost or repeated since the last one. Called by Decode() with state_ locked.
+inline void Session::Stamp(uint8_t timer, uint64_t now) {
+    if (state_.seq == 1) {
+        timer_last_ = timer;
+        timer_recv_ = now;
+        timer_offset_ = now;
+        state_.ticks = 0;
+        state_.timestamp = now;
+        return;
+    }
+    uint64_t delta = static_cast<uint8_t>(timer - timer_last_);
+    // the byte hides whole wraps after a silence longer than half of one, count them by receive time
+    uint64_t elapsed = (now - timer_recv_) / TIMER_TICK_NS;
+    if (elapsed > delta + 128)
+        delta += (elapsed - delta + 128) / 256 * 256;
+    timer_recv_ = now;
+    if (delta == 0) {
+        counters_.duplicates.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    // a report advances the timer by a fixed step, reports missing in between are counted in
+    // steps of the smallest advance seen
+    if (timer_step_ == 0 || delta < timer_step_)
+        timer_step_ = delta;
+    uint64_t reports = (delta + timer_step_ / 2) / timer_step_;
+    if (reports > 1)
+        counters_.lost.fetch_add(reports - 1, std::memory_order_relaxed);
+    timer_last_ = timer;
+    state_.ticks += delta;
+    // tick 0 sits at the earliest receive time seen for it, the report with the least latency,
+    // and creeps later so that a device clock slower than TIMER_TICK_NS is followed
+    int64_t ticks_ns = state_.ticks * TIMER_TICK_NS;
+    int64_t offset = now - ticks_ns;
+    timer_offset_ = offset < timer_offset_ + (int64_t)TIMER_DRIFT_NS ? offset : timer_offset_ + TIMER_DRIFT_NS;
+    uint64_t timestamp = timer_offset_ + ticks_ns;
+    state_.timestamp = timestamp > state_.timestamp ? timestamp : state_.timestamp + 1;
+}
+
+size_t Session::ReadButtonEvents(ButtonEvent *events, size_t count) {
+    uint64_t tail = button_tail_.load(std::memory_order_relaxed);
+    uint64_t head = button_head_.load(std::memory_order_acquire);
+    size_t n = head - tail < count ? head - tail : count;
+    for (size_t i = 0; i < n; ++i)
+        events[i] = button_events_[(tail + i) & (BUTTON_EVENT_SLOTS - 1)];
+    button_tail_.store(tail + n, std::memory_order_release);
+    return n;
+}
+
+bool Session::GetState(InputState &state) const {
+    for (;;) {
+        int begin = state_lock_.load(std::memory_order_acquire);
+        if (begin & 1)
+            continue;
+        memcpy(&state, &state_, sizeof(state));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (state_lock_.load(std::memory_order_relaxed) == begin)
+            return state.seq > 0;
+    }
+}
+
+Result Session::WaitState(InputState &state, uint64_t seq, unsigned timeout) {
+    Result ret = TIMEDOUT;
+    uint64_t deadline = monotonic_ns() + timeout * 1000000ull;
+    state_waiters_.fetch_add(1);
+    for (;;) {
+        int wake = state_wake_.load();
+        if (GetState(state) && state.seq > seq) {
+            ret = DONE;
+            break;
+        }
+        if (!is_alive_) {
+            ret = ABORT;
+            break;
+        }
+        uint64_t now = monotonic_ns();
+        if (now >= deadline)
+            break;
+        struct timespec ts = {
+            .tv_sec = static_cast<time_t>((deadline - now) / 1000000000ull),
+            .tv_nsec = static_cast<long>((deadline - now) % 1000000000ull),
+        };
+        // a state published or a stop since wake was read returns at once
+        futex_wait(&state_wake_, wake, &ts);
+    }
+    state_waiters_.fetch_sub(1);
+    return ret;
+}
+
+// The caller thread takes the place of the poll thread, as the ring producer and for sweeping
+// expired tasks.
+ssize_t Session::Feed(const void *report, size_t size) {
+    if (!ring_ || remote_.recver || remote_.batch_recver)
+        return -EINVAL;
+    if (!is_alive_)
+        return -EPIPE;
+    if (size == 0)
+        return 0;
+    size_t limit = recv_size_.load(std::memory_order_relaxed);
+    size = size < limit ? size : limit;
+    void *buffer = size > remote_.recv_size ? large_buffer_ : ring_->Acquire();
+    memcpy(buffer, report, size);
+    uint64_t now = monotonic_ns();
+    Link(true);
+    Deliver(buffer, size, now);
+    Expire(now);
+    return size;
+}
+
+// One poll loop with the batch recver, reports are received straight into the ring.
+inline void Session::PollBatch() {
+    // large reports are taken one at a time
+    if (recv_size_.load(std::memory_order_relaxed) > remote_.recv_size)
+        return PollOnce();
+    size_t sizes[RECV_BATCH];
+    size_t count = RECV_BATCH;
+    auto buffer = reinterpret_cast<uint8_t *>(ring_->Acquire(count));
+    ssize_t ret = remote_.batch_recver(buffer, remote_.recv_size, count, sizes);
+    uint64_t now = monotonic_ns();
+    if (ret < 0) {
+        counters_.recv_errors.fetch_add(1, std::memory_order_relaxed);
+        debug("recv error %ld, err_count %d", ret, err_count_.load());
+        Backoff(Link(false));
+    } else if (ret > 0) {
+        Link(true);
+        count = static_cast<size_t>(ret) < count ? ret : count;
+        counters_.received.fetch_add(count, std::memory_order_relaxed);
+        for (size_t i = 0; i < count; ++i) {
+            counters_.reports[buffer[i * remote_.recv_size]].fetch_add(1, std::memory_order_relaxed);
+            ring_->Publish(sizes[i], now);
+            Decode(buffer + i * remote_.recv_size, sizes[i], now);
+        }
+        Dispatch(buffer, count, now);
+    }
+    Expire(now);
+}
+
+static inline struct timespec to_timespec(uint64_t ns) {
+    struct timespec ts = {
+        .tv_sec = static_cast<time_t>(ns / 1000000000ull),
+        .tv_nsec = static_cast<long>(ns % 1000000000ull),
+    };
+    return ts;
+}
+
+// Start the push timer, it fires at absolute deadlines so the time spent sending does not
+// drift the period.
+inline int Session::StartPush() {
+    push_timer_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (push_timer_ < 0)
+        return errno;
+    push_deadline_ = monotonic_ns();
+    push_last_ = 0;
+    struct itimerspec spec = {
+        .it_interval = to_timespec(push_period_),
+        .it_value = to_timespec(push_deadline_ + push_period_),
+    };
+    if (timerfd_settime(push_timer_, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+        return errno;
+    return 0;
+}
+
 void *Session::Push() {
-    push_running_ = true;
     int ret = 0;
-#ifdef __android__
-    signal(SIGQUIT, [](int signo) {
-        pthread_exit(nullptr);
-    });
-#else
-    ret = pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-    assert(ret == 0);
-    ret = pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
-    assert(ret == 0);
-#endif
     debug("enter push thread ...");
+    struct pollfd fds[2] = {
+        {.fd = push_timer_, .events = POLLIN, .revents = 0},
+        {.fd = stop_fd_, .events = POLLIN, .revents = 0},
+    };
     while (is_alive_) {
-        switch (push_type_) {
-        case FREE:
-            debug("I am not should not be here");
-            break;
-        case TIMED:
-            if (!push_sem_.Valid()) {
-                ret = Send(send_buffer_);
-                if (ret < 0) {
-                    err_count_++;
-                    debug("send error %d, err_count %d", ret, err_count_);
-                    if (err_count_ > 100) {
-                        debug("over 100 times error occurred, dozing...");
-                        msleep(100);
-                    }
+        ret = poll(fds, 2, -1);
+        if (ret < 0 || fds[1].revents)
+            continue;
+        PushOnce();
+    }
+    debug("exit push thread ...");
+    return NULL;
+}
+
+// Send one report if the push timer fired, or all queued reports of QUEUED push.
+inline void Session::PushOnce() {
+    int ret = 0;
+    uint64_t expired = 0;
+    if (push_type_ == QUEUED)
+        return Drain();
+    if (read(push_timer_, &expired, sizeof(expired)) != sizeof(expired))
+        return;
+    // periods already missed are skipped instead of bursting to catch up
+    push_deadline_ += expired * push_period_;
+    uint64_t now = monotonic_ns();
+    bool subcmd = false;
+    {
+        // one queued report per period, plain rumble if none
+        std::lock_guard<std::mutex> _1(push_lock_);
+        auto buffer = reinterpret_cast<uint8_t *>(send_buffer_);
+        if (push_head_ != push_tail_) {
+            memcpy(buffer, push_queue_ + (push_tail_ & (PUSH_QUEUE_SLOTS - 1)) * remote_.send_size,
+                   remote_.send_size);
+            push_tail_++;
+            subcmd = true;
+        } else {
+            bzero(buffer, remote_.send_size);
+            buffer[0] = REPORT_RUMBLE_ONLY;
+        }
+        memcpy(buffer + REPORT_RUMBLE, rumble_, RUMBLE_SIZE);
+    }
+    ret = Send(send_buffer_);
+    if (ret < 0) {
+        debug("send error %d, err_count %d", ret, err_count_.load());
+        Backoff(Link(false));
+    }
+    Account(now, push_last_, push_deadline_, expired - 1, subcmd);
+    push_last_ = now;
+}
+
+// Send the reports queued by Transmit until the queue is empty. A slow sender only holds
+// back this thread, callers keep queueing until the queue is full.
+inline void Session::Drain() {
+    uint64_t count = 0;
+    uint64_t reports = 0, subcmds = 0;
+    if (read(push_timer_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return;
+    void *buffer;
+    while ((buffer = send_queue_->Front()) != nullptr) {
+        if (*reinterpret_cast<uint8_t *>(buffer) != REPORT_RUMBLE_ONLY)
+            subcmds++;
+        ssize_t ret = Send(buffer);
+        send_queue_->Pop();
+        reports++;
+        if (ret < 0) {
+            debug("send error %ld, err_count %d", ret, err_count_.load());
+            Backoff(Link(false));
+        }
+    }
+    if (reports > 0) {
+        std::lock_guard<std::mutex> _1(push_lock_);
+        push_stats_.reports += reports;
+        push_stats_.subcmds += subcmds;
+    }
+}
+
+static inline uint8_t report_subcmd(const uint8_t *report) {
+    return report[0] == 0x21 ? report[14] : ROUTE_ANY;
+}
+
+// route table slots a report may be routed to
+static inline uint32_t report_slots(const uint8_t *report) {
+    uint8_t subcmd = report_subcmd(report);
+    uint32_t slots = (1u << Route().Slot()) | (1u << Route(report[0]).Slot());
+    if (subcmd != ROUTE_ANY)
+        slots |= 1u << Route(report[0], subcmd).Slot();
+    return slots;
+}
+
+// Pass the reports only to the tasks routed to them. A 0x21 reply is looked up by (id, subcmd),
+// (id, ANY) and (ANY, ANY); other reports by (id, ANY) and (ANY, ANY). Reports that no one
+// is waiting for return before taking task_lock_, a batch of reports takes it once.
+void Session::Dispatch(const void *buffer, size_t count, uint64_t now) {
+    auto reports = reinterpret_cast<const uint8_t *>(buffer);
+    uint32_t slots = 0;
+    for (size_t i = 0; i < count; ++i)
+        slots |= report_slots(reports + i * remote_.recv_size);
+    if (!(slots & route_mask_.load(std::memory_order_acquire)))
+        return;
+    std::lock_guard<std::mutex> _1(task_lock_);
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t *report = reports + i * remote_.recv_size;
+        uint8_t id = report[0];
+        uint8_t subcmd = report_subcmd(report);
+        slots = report_slots(report) & route_mask_.load(std::memory_order_relaxed);
+        while (slots) {
+            unsigned slot = __builtin_ctz(slots);
+            slots &= slots - 1;
+            Task *task = task_table_[slot].Front();
+            while (task) {
+                Task *next = RouteList::Next(task);
+                if (task->route().Match(id, subcmd) && task->Test(report, now)) {
+                    if (task->route().subcmd < STATS_SUBCMDS && task->state_.load(std::memory_order_relaxed) == DONE)
+                        counters_.rtt[subcmd].Record((now - task->start()) / 1000);
+                    Remove(task);
                 }
-                push_sem_.Post();
+                task = next;
             }
-            msleep(16);
-            break;
-        default:
-            break;
         }
     }
-    push_running_ = false;
-    debug("exit push thread ...");
-    pthread_exit(NULL);
-    return NULL;
 }
 
-inline void Session::Append(TaskSp &&task) {
-    if (!is_alive_ /*|| !poll_running_*/) {
-        task->Abort();
+// first tick at or after a deadline, a task swept there has surely expired
+static inline uint64_t deadline_tick(uint64_t deadline) {
+    return (deadline + WHEEL_TICK - 1) / WHEEL_TICK;
+}
+
+// Sweep the timer wheel up to now, timing out tasks whose deadline passed and dropping
+// tasks completed elsewhere. Tasks whose deadline is further than one turn, or was pushed
+// back by AGAIN, move to the slot of their deadline. Poll thread only.
+void Session::Expire(uint64_t now) {
+    uint64_t tick = now / WHEEL_TICK;
+    uint64_t last = wheel_tick_.load(std::memory_order_relaxed);
+    if (tick <= last)
+        return;
+    if (armed_.load(std::memory_order_relaxed) == 0) {
+        wheel_tick_.store(tick, std::memory_order_relaxed);
         return;
     }
     std::lock_guard<std::mutex> _1(task_lock_);
-    task_queue_.emplace_back(std::move(task));
+    last = wheel_tick_.load(std::memory_order_relaxed);
+    if (tick - last > WHEEL_SLOTS)
+        last = tick - WHEEL_SLOTS;
+    for (uint64_t t = last + 1; t <= tick; ++t) {
+        unsigned slot = t & (WHEEL_SLOTS - 1);
+        Task *task = wheel_[slot].Front();
+        while (task) {
+            Task *next = WheelList::Next(task);
+            if (task->state_.load(std::memory_order_relaxed) != WAITING || task->Expired(now)) {
+                task->Timeout();
+                Remove(task);
+            } else if ((deadline_tick(task->deadline()) & (WHEEL_SLOTS - 1)) != slot) {
+                wheel_[slot].Erase(task);
+                Schedule(task);
+            }
+            task = next;
+        }
+    }
+    wheel_tick_.store(tick, std::memory_order_relaxed);
+}
+
+// Update push statistics with a report sent at now, woken up for deadline after missing
+// `missed` periods. Push thread only.
+void Session::Account(uint64_t now, uint64_t last, uint64_t deadline, uint64_t missed, bool subcmd) {
+    std::lock_guard<std::mutex> _1(push_lock_);
+    uint64_t late = now > deadline ? now - deadline : 0;
+    push_stats_.reports++;
+    if (subcmd)
+        push_stats_.subcmds++;
+    push_stats_.missed += missed;
+    push_late_sum_ += late;
+    if (late > push_stats_.late_max)
+        push_stats_.late_max = late;
+    if (last) {
+        uint64_t period = now - last;
+        push_period_sum_ += period;
+        if (push_stats_.period_min == 0 || period < push_stats_.period_min)
+            push_stats_.period_min = period;
+        if (period > push_stats_.period_max)
+            push_stats_.period_max = period;
+    }
 }
 
-std::future<Result> Session::Transmit(unsigned int retry, const void *buffer, const Inspector &inspector) {
+PushStats Session::GetPushStats() {
+    std::lock_guard<std::mutex> _1(push_lock_);
+    PushStats stats = push_stats_;
+    if (send_queue_)
+        stats.depth = send_queue_->Depth();
+    if (stats.reports > 0)
+        stats.late_avg = push_late_sum_ / stats.reports;
+    if (stats.reports > 1)
+        stats.period_avg = push_period_sum_ / (stats.reports - 1);
+    return stats;
+}
+
+// Queue a report for TIMED push, or take its rumble if it carries nothing else. QUEUED
+// push queues every report and wakes the push thread.
+// Returns -EAGAIN if the queue is full and -ENODEV if the device has no sender.
+inline int Session::Enqueue(const void *buffer) {
+    auto report = reinterpret_cast<const uint8_t *>(buffer);
+    // no push queue is set up without a sender
+    if (!remote_.sender)
+        return -ENODEV;
+    if (push_type_ == QUEUED) {
+        {
+            std::lock_guard<std::mutex> _1(push_lock_);
+            void *slot = send_queue_->Reserve();
+            if (slot == nullptr) {
+                push_stats_.dropped++;
+                return -EAGAIN;
+            }
+            memcpy(slot, buffer, remote_.send_size);
+            send_queue_->Commit();
+            uint64_t depth = send_queue_->Depth();
+            if (depth > push_stats_.depth_max)
+                push_stats_.depth_max = depth;
+        }
+        // woken for every report, the push thread may have found the queue empty just before
+        uint64_t one = 1;
+        ssize_t ret = write(push_timer_, &one, sizeof(one));
+        assert(ret == sizeof(one));
+        return 0;
+    }
+    std::lock_guard<std::mutex> _1(push_lock_);
+    if (report[0] == REPORT_RUMBLE_ONLY) {
+        memcpy(rumble_, report + REPORT_RUMBLE, RUMBLE_SIZE);
+        return 0;
+    }
+    if (push_head_ - push_tail_ == PUSH_QUEUE_SLOTS) {
+        push_stats_.dropped++;
+        return -EAGAIN;
+    }
+    memcpy(push_queue_ + (push_head_ & (PUSH_QUEUE_SLOTS - 1)) * remote_.send_size, buffer, remote_.send_size);
+    push_head_++;
+    return 0;
+}
+
+// count a completed task by its result
+inline void Session::Count(int result) {
+    switch (result) {
+    case DONE:
+        counters_.done.fetch_add(1, std::memory_order_relaxed);
+        break;
+    case TIMEDOUT:
+        counters_.timeouts.fetch_add(1, std::memory_order_relaxed);
+        break;
+    case ABORT:
+    case AGAIN:
+        counters_.aborts.fetch_add(1, std::memory_order_relaxed);
+        break;
+    default:
+        counters_.errors.fetch_add(1, std::memory_order_relaxed);
+        break;
+    }
+}
+
+void Session::GetStats(SessionStats &stats) const {
+    stats.sent = counters_.sent.load(std::memory_order_relaxed);
+    stats.send_errors = counters_.send_errors.load(std::memory_order_relaxed);
+    stats.received = counters_.received.load(std::memory_order_relaxed);
+    stats.recv_errors = counters_.recv_errors.load(std::memory_order_relaxed);
+    stats.done = counters_.done.load(std::memory_order_relaxed);
+    stats.timeouts = counters_.timeouts.load(std::memory_order_relaxed);
+    stats.aborts = counters_.aborts.load(std::memory_order_relaxed);
+    stats.errors = counters_.errors.load(std::memory_order_relaxed);
+    stats.lost = counters_.lost.load(std::memory_order_relaxed);
+    stats.duplicates = counters_.duplicates.load(std::memory_order_relaxed);
+    for (unsigned i = 0; i < 256; ++i)
+        stats.reports[i] = counters_.reports[i].load(std::memory_order_relaxed);
+    for (unsigned i = 0; i < STATS_SUBCMDS; ++i)
+        counters_.rtt[i].Load(stats.rtt[i]);
+}
+
+uint64_t Session::Head() const {
+    return ring_ ? ring_->Head() : 0;
+}
+
+ssize_t Session::Read(uint64_t seq, void *buffer, size_t size, uint64_t *time) const {
+    if (!ring_)
+        return -ENODEV;
+    return ring_->Read(seq, buffer, size, time);
+}
+
+// Takes over the session reference of task, returns false if the session is stopping.
+inline bool Session::Append(Task *task) {
+    if (!is_alive_ /*|| !poll_running_*/) {
+        task->Abort();
+        Count(ABORT);
+        task->Release();
+        return false;
+    }
+    bool idle = false;
+    {
+        std::lock_guard<std::mutex> _1(task_lock_);
+        unsigned slot = task->route().Slot();
+        task_table_[slot].PushBack(task);
+        route_mask_.fetch_or(1u << slot, std::memory_order_release);
+        Schedule(task);
+        idle = armed_.fetch_add(1, std::memory_order_relaxed) == 0;
+    }
+    // a poll thread waiting on poll_fd without timeout has to start ticking
+    if (idle && remote_.pollable) {
+        uint64_t one = 1;
+        ssize_t ret = write(wake_fd_, &one, sizeof(one));
+        assert(ret == sizeof(one));
+    }
+    return true;
+}
+
+// Put task in the wheel slot of its deadline, never in a tick already swept.
+// Called with task_lock_ held.
+inline void Session::Schedule(Task *task) {
+    uint64_t tick = deadline_tick(task->deadline());
+    uint64_t last = wheel_tick_.load(std::memory_order_relaxed);
+    if (tick <= last)
+        tick = last + 1;
+    task->wheel_slot_ = tick & (WHEEL_SLOTS - 1);
+    wheel_[task->wheel_slot_].PushBack(task);
+}
+
+// Unlink task from route table and timer wheel, drop the session reference.
+// Called with task_lock_ held.
+inline void Session::Remove(Task *task) {
+    unsigned slot = task->route().Slot();
+    task_table_[slot].Erase(task);
+    if (task_table_[slot].Empty())
+        route_mask_.fetch_and(~(1u << slot), std::memory_order_relaxed);
+    wheel_[task->wheel_slot_].Erase(task);
+    armed_.fetch_sub(1, std::memory_order_relaxed);
+    Count(task->state_.load(std::memory_order_relaxed));
+    task->Release();
+}
+
+Future Session::Transmit(unsigned int timeout, const void *buffer, const Route &route, const Inspector &inspector) {
     //debug();
     int ret = 0;
-    auto sp = task_pool_.Get();
-    auto future = sp->Reset(retry, inspector);
+    bool queued = false;
+    Task *task = task_pool_->Get();
+    task->Reset(timeout, route, inspector);
+    task->start_ = monotonic_ns();
+    task->Arm(task->start_);
+    Future future(task);
     if (!is_alive_) goto abort;
+    // the report still goes out while the link is lost, a reply is not waited for
+    if (inspector && link_state_.load(std::memory_order_relaxed) == LINK_LOST) {
+        task->Complete(LOST);
+        if (buffer && push_type_ == FREE) {
+            if (SendCopy(buffer) < 0)
+                Link(false);
+        } else if (buffer) {
+            Enqueue(buffer);
+        }
+        goto done;
+    }
+    if (inspector) {
+        // queue the task before sending, the reply may be dispatched before Send returns
+        if (!Append(task))
+            return future;
+        queued = true;
+    }
     if (buffer) {
         if (push_type_ == FREE) {
-            ret = Send(buffer);
-            if (ret < 0) sp->Error();
-        } else {
-            push_sem_.Wait();
-            if (!is_alive_) goto abort;
-            memmove(send_buffer_, buffer, remote_.send_size);
+            ret = SendCopy(buffer);
+            if (ret < 0) {
+                Link(false);
+                goto error;
+            }
+        } else if ((ret = Enqueue(buffer)) < 0) {
+            if (ret == -EAGAIN)
+                goto busy;
+            goto error;
         }
     }
-    if (inspector)
-        Append(std::move(sp));
-    else
-        sp->Done();
+    if (queued)
+        return future;
+    task->Done();
     goto done;
 
+    // a queued task that failed is dropped from the table by the poll thread
+busy:
+    task->Complete(AGAIN);
+    goto done;
+error:
+    task->Error();
+    goto done;
 abort:
-    sp->Abort();
+    task->Abort();
 done:
+    if (!queued) {
+        Count(task->state_.load(std::memory_order_relaxed));
+        task->Release();
+    }
     return future;
 }
+
+// event sources of the epoll data, tagged with the registration id of their session
+enum {
+    SOURCE_STOP,
+    SOURCE_POLL,
+    SOURCE_WAKE,
+    SOURCE_PUSH,
+};
+#define REACTOR_EVENTS 32
+
+Reactor::Reactor(unsigned threads) : stop_fd_(-1), next_id_(1), loops_(threads > 0 ? threads : 1) {
+    int ret = 0;
+    stop_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stop_fd_ < 0)
+        throw std::runtime_error(strerror(errno));
+    for (auto &loop : loops_) {
+        loop.reactor = this;
+        loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop.epoll_fd < 0) {
+            ret = errno;
+            goto error;
+        }
+        struct epoll_event event = {.events = EPOLLIN, .data = {.u64 = SOURCE_STOP}};
+        ret = epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, stop_fd_, &event);
+        assert(ret == 0);
+        auto run = [](void *arg) -> void * {
+            auto loop = reinterpret_cast<Loop *>(arg);
+            loop->reactor->Run(*loop);
+            return NULL;
+        };
+        ret = pthread_create(&loop.thread, NULL, run, &loop);
+        assert(ret == 0);
+        loop.running = true;
+    }
+    return;
+
+error:
+    Stop();
+    throw std::runtime_error(strerror(ret));
+}
+
+Reactor::~Reactor() {
+    Stop();
+}
+
+void Reactor::Stop() {
+    int ret = 0;
+    uint64_t one = 1;
+    ret = write(stop_fd_, &one, sizeof(one));
+    assert(ret == sizeof(one));
+    for (auto &loop : loops_) {
+        if (loop.running) {
+            ret = pthread_join(loop.thread, nullptr);
+            assert(ret == 0);
+            loop.running = false;
+        }
+        assert(loop.sessions.empty());
+        if (loop.epoll_fd >= 0)
+            close(loop.epoll_fd);
+        loop.epoll_fd = -1;
+    }
+    close(stop_fd_);
+}
+
+size_t Reactor::Size() {
+    size_t size = 0;
+    for (auto &loop : loops_) {
+        std::lock_guard<std::mutex> _1(loop.lock);
+        size += loop.sessions.size();
+    }
+    return size;
+}
+
+// Hand the fds of session to the loop serving the fewest sessions. Only that loop touches
+// the session from now on, like its own poll and push threads would.
+void Reactor::Add(Session *session) {
+    int ret = 0;
+    Loop *loop = nullptr;
+    size_t least = 0;
+    // each count is read under its own loop's lock, the pick is only a balancing hint
+    for (auto &l : loops_) {
+        std::lock_guard<std::mutex> _1(l.lock);
+        if (loop == nullptr || l.sessions.size() < least) {
+            loop = &l;
+            least = l.sessions.size();
+        }
+    }
+    std::lock_guard<std::mutex> _1(loop->lock);
+    uint64_t id = next_id_.fetch_add(1);
+    session->reactor_ = this;
+    session->reactor_id_ = id;
+    loop->sessions.push_back({id, session, false});
+    const struct {
+        int fd;
+        uint64_t source;
+    } sources[] = {
+        {session->remote_.poll_fd, SOURCE_POLL},
+        {session->wake_fd_, SOURCE_WAKE},
+        {session->push_timer_, SOURCE_PUSH},
+    };
+    for (auto &source : sources) {
+        if (source.fd < 0)
+            continue;
+        struct epoll_event event = {.events = EPOLLIN, .data = {.u64 = id << 2 | source.source}};
+        ret = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source.fd, &event);
+        assert(ret == 0);
+    }
+}
+
+// Returns once the loop of session is done with it. Events of the session already taken
+// by epoll_wait are dropped by their stale id.
+void Reactor::Remove(Session *session) {
+    for (auto &loop : loops_) {
+        std::lock_guard<std::mutex> _1(loop.lock);
+        auto it = std::find_if(loop.sessions.begin(), loop.sessions.end(),
+                               [session](const Entry &e) { return e.session == session; });
+        if (it == loop.sessions.end())
+            continue;
+        for (int fd : {session->remote_.poll_fd, session->wake_fd_, session->push_timer_})
+            if (fd >= 0)
+                epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        loop.sessions.erase(it);
+        break;
+    }
+    session->reactor_ = nullptr;
+}
+
+void Reactor::Run(Loop &loop) {
+    struct epoll_event events[REACTOR_EVENTS];
+    bool armed = false;
+    debug("enter reactor loop ...");
+    for (;;) {
+        // tick the timer wheels only while some task is pending
+        int n = epoll_wait(loop.epoll_fd, events, REACTOR_EVENTS, armed ? WHEEL_TICK / 1000000 : -1);
+        if (n < 0 && errno != EINTR) {
+            debug("epoll error %d", errno);
+            break;
+        }
+        std::lock_guard<std::mutex> _1(loop.lock);
+        for (int i = 0; i < n; ++i) {
+            uint64_t id = events[i].data.u64 >> 2;
+            unsigned source = events[i].data.u64 & 3;
+            if (source == SOURCE_STOP) {
+                debug("exit reactor loop ...");
+                return;
+            }
+            auto it = std::find_if(loop.sessions.begin(), loop.sessions.end(),
+                                   [id](const Entry &e) { return e.id == id; });
+            if (it == loop.sessions.end())
+                continue;
+            Session *session = it->session;
+            uint64_t count = 0;
+            switch (source) {
+            case SOURCE_POLL:
+                // the session may have started backing off earlier in this batch
+                if (session->resume_)
+                    break;
+                if (session->remote_.batch_recver)
+                    session->PollBatch();
+                else
+                    session->PollOnce();
+                break;
+            case SOURCE_WAKE:
+                if (read(session->wake_fd_, &count, sizeof(count)) < 0)
+                    debug("wake error %d", errno);
+                break;
+            case SOURCE_PUSH:
+                if (!session->resume_)
+                    session->PushOnce();
+                break;
+            }
+        }
+        uint64_t now = monotonic_ns();
+        armed = false;
+        for (auto &entry : loop.sessions) {
+            Session *session = entry.session;
+            // a session backing off sits out of the epoll set until its resume time, on the ticks
+            bool backoff = session->resume_ > now;
+            if (!backoff)
+                session->resume_ = 0;
+            if (backoff != entry.paused)
+                Pause(loop, entry, backoff);
+            session->Expire(now);
+            armed = armed || backoff || session->armed_.load(std::memory_order_relaxed) > 0;
+        }
+    }
+}
+
+// Take the I/O fds of a session out of the epoll set of loop, or put them back. Its wake_fd_
+// stays, new tasks still arm the ticks.
+void Reactor::Pause(Loop &loop, Entry &entry, bool pause) {
+    const struct {
+        int fd;
+        uint64_t source;
+    } sources[] = {
+        {entry.session->remote_.poll_fd, SOURCE_POLL},
+        {entry.session->push_timer_, SOURCE_PUSH},
+    };
+    for (auto &source : sources) {
+        if (source.fd < 0)
+            continue;
+        struct epoll_event event = {.events = EPOLLIN, .data = {.u64 = entry.id << 2 | source.source}};
+        int ret = epoll_ctl(loop.epoll_fd, pause ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, source.fd, &event);
+        assert(ret == 0);
+    }
+    entry.paused = pause;
+}
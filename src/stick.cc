@@ -0,0 +1,76 @@
+/*
+ *   Copyright (c) 2020 mumumusuc
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "stick.h"
+
+using namespace controller;
+
+// calibration of a stick without one in flash
+static const StickCalibration NOMINAL = {
+    .center = {0x800, 0x800},
+    .above = {0x600, 0x600},
+    .below = {0x600, 0x600},
+};
+
+// two 12 bit values packed into 3 bytes
+static inline void unpack12(const uint8_t *src, uint16_t *value) {
+    value[0] = (src[1] << 8 & 0xf00) | src[0];
+    value[1] = (src[2] << 4) | (src[1] >> 4);
+}
+
+// left: above center, center, below center; right: center, below center, above center
+bool StickCalibration::Parse(const uint8_t *block, bool right) {
+    StickCalibration parsed;
+    unpack12(block, right ? parsed.center : parsed.above);
+    unpack12(block + 3, right ? parsed.below : parsed.center);
+    unpack12(block + 6, right ? parsed.above : parsed.below);
+    // blank flash reads 0xfff
+    for (int i = 0; i < 2; ++i) {
+        if (parsed.center[i] == 0xfff || parsed.above[i] == 0 || parsed.below[i] == 0) {
+            *this = NOMINAL;
+            return false;
+        }
+    }
+    *this = parsed;
+    return true;
+}
+
+// distance from center scaled to STICK_MAX at the calibrated reach, past the deadzone
+static void build_axis(int16_t *lut, uint16_t center, uint16_t above, uint16_t below, uint16_t deadzone) {
+    for (int raw = 0; raw < static_cast<int>(STICK_RAW_RANGE); ++raw) {
+        int distance = raw > center ? raw - center : center - raw;
+        int reach = raw > center ? above : below;
+        int value = 0;
+        if (distance > deadzone && reach > deadzone) {
+            value = (distance - deadzone) * STICK_MAX / (reach - deadzone);
+            if (value > STICK_MAX)
+                value = STICK_MAX;
+        }
+        lut[raw] = raw > center ? value : -value;
+    }
+}
+
+StickDecoder::StickDecoder() {
+    Load(false, NOMINAL);
+    Load(true, NOMINAL);
+}
+
+void StickDecoder::Load(bool right, const StickCalibration &calibration, uint16_t deadzone) {
+    for (int axis = 0; axis < 2; ++axis)
+        build_axis(lut_[(right ? 2 : 0) + axis], calibration.center[axis], calibration.above[axis],
+                   calibration.below[axis], deadzone);
+}
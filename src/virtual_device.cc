@@ -0,0 +1,467 @@
+/*
+ *   Copyright (c) 2020 mumumusuc
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "virtual_device.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define MCU_MAJOR 0x0005
+#define MCU_MINOR 0x0018
+#define FLASH_SECTOR 0x1000
+#define DEBUG 1
+#if DEBUG
+#define debug(fmt, ...) log_d(__func__, fmt, ##__VA_ARGS__)
+#else
+#define debug(fmt, ...)
+#endif
+
+using namespace virtual_device;
+
+static const uint8_t MAC_ADDRESS[FLASH_ADDR_MAC_LEN] = {0x01, 0x00, 0x00, 0xe9, 0xb6, 0x98};
+
+// two 12 bit values packed into 3 bytes, the layout of sticks and stick calibration
+static inline void pack12(uint8_t *dst, uint16_t x, uint16_t y) {
+    dst[0] = x & 0xff;
+    dst[1] = ((x >> 8) & 0x0f) | ((y & 0x0f) << 4);
+    dst[2] = (y >> 4) & 0xff;
+}
+
+static inline void put16(uint8_t *dst, int16_t value) {
+    dst[0] = value & 0xff;
+    dst[1] = (value >> 8) & 0xff;
+}
+
+VirtualController::VirtualController(Category category, unsigned period)
+    : category_(category), period_(period), fds_{-1, -1}, stop_fd_(-1), timer_fd_(-1), running_(false),
+      flash_(FLASH_MEM_SIZE, 0xff), data_(), timer_(0), mode_(POLL_SIMPLE_HID), player_(0), imu_(false),
+      vibration_(false), low_power_(false), mcu_state_(MCU_STATE_SUSPEND), mcu_mode_(0),
+      ir_mode_(IR_MODE_NONE), ir_fragments_(0), ir_fragment_(0), ir_sent_(false), ir_frame_(0), samples_(0),
+      stats_() {
+    int ret = 0;
+    struct itimerspec spec = {};
+    auto stream = [](void *arg) -> void * {
+        return reinterpret_cast<VirtualController *>(arg)->Stream();
+    };
+    Format();
+    // sticks rest at the center of the side the device has
+    if (category_ != JOYCON_R)
+        pack12(data_.left_stick.raw, 0x800, 0x800);
+    if (category_ != JOYCON_L)
+        pack12(data_.right_stick.raw, 0x800, 0x800);
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, fds_) < 0)
+        goto error;
+    stop_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (stop_fd_ < 0 || timer_fd_ < 0)
+        goto error;
+    if (period_ > 0) {
+        spec.it_interval.tv_sec = period_ / 1000000;
+        spec.it_interval.tv_nsec = (period_ % 1000000) * 1000;
+        spec.it_value = spec.it_interval;
+        if (timerfd_settime(timer_fd_, 0, &spec, NULL) < 0)
+            goto error;
+    }
+    ret = pthread_create(&thread_, NULL, stream, this);
+    if (ret != 0) {
+        errno = ret;
+        goto error;
+    }
+    running_ = true;
+    return;
+
+error:
+    ret = errno;
+    for (int fd : {fds_[0], fds_[1], stop_fd_, timer_fd_})
+        if (fd >= 0)
+            close(fd);
+    throw std::runtime_error(strerror(ret));
+}
+
+VirtualController::~VirtualController() {
+    uint64_t stop = 1;
+    if (running_) {
+        if (write(stop_fd_, &stop, sizeof(stop)) < 0)
+            debug("stop error %d", errno);
+        pthread_join(thread_, NULL);
+    }
+    for (int fd : {fds_[0], fds_[1], stop_fd_, timer_fd_})
+        close(fd);
+}
+
+// factory data of the spi flash, the rest is erased
+void VirtualController::Format() {
+    static const ControllerColor colors[] = {
+        make_controller_color(0x323232, 0xffffff, 0x323232, 0x323232), // PRO_GRIP
+        make_controller_color(0x0ab9e6, 0x001e1e, 0x0ab9e6, 0x0ab9e6), // JOYCON_L
+        make_controller_color(0xff3c28, 0x1e0a0a, 0xff3c28, 0xff3c28), // JOYCON_R
+    };
+    uint8_t *flash = flash_.data();
+    memcpy(flash + FLASH_ADDR_MAC_LE, MAC_ADDRESS, FLASH_ADDR_MAC_LEN);
+    memset(flash + FLASH_ADDR_SN, 0, FLASH_ADDR_SN_LEN);
+    memcpy(flash + FLASH_ADDR_SN, "XCW10000000001", 14);
+    flash[FLASH_ADDR_DEVICE_TYPE] = category_ == PRO_GRIP ? 3 : category_;
+    // acc origin, acc sensitivity, gyro origin, gyro sensitivity, x y z each
+    const int16_t imu[] = {0, 0, 0, 0x4000, 0x4000, 0x4000, 0, 0, 0, 0x343b, 0x343b, 0x343b};
+    for (size_t i = 0; i < sizeof(imu) / sizeof(imu[0]); ++i)
+        put16(flash + FLASH_ADDR_IMU_CALIB + i * 2, imu[i]);
+    // left: above center, center, below center; right: center, below center, above center
+    uint8_t *stick = flash + FLASH_ADDR_STICK_L_CALIB;
+    pack12(stick, 0x600, 0x600);
+    pack12(stick + 3, 0x800, 0x800);
+    pack12(stick + 6, 0x600, 0x600);
+    stick = flash + FLASH_ADDR_STICK_R_CALIB;
+    pack12(stick, 0x800, 0x800);
+    pack12(stick + 3, 0x600, 0x600);
+    pack12(stick + 6, 0x600, 0x600);
+    memcpy(flash + FLASH_ADDR_COLOR, &colors[category_ < JOYCON ? category_ : PRO_GRIP], FLASH_ADDR_COLOR_LEN);
+}
+
+DeviceFunc VirtualController::Func(size_t recv_size) {
+    DeviceFunc func = {};
+    int fd = fds_[0];
+    func.sender = [this](const void *buffer, size_t size) { return Handle(buffer, size); };
+    func.recver = [fd](void *buffer, size_t size) -> ssize_t {
+        ssize_t ret = read(fd, buffer, size);
+        if (ret < 0)
+            return errno == EAGAIN ? 0 : -errno;
+        return ret;
+    };
+    func.send_size = OUTPUT_REPORT_SIZE;
+    func.recv_size = recv_size;
+    func.batch_recver = [fd](void *buffer, size_t stride, size_t count, size_t *sizes) -> ssize_t {
+        auto dst = reinterpret_cast<uint8_t *>(buffer);
+        size_t n = 0;
+        for (; n < count; ++n) {
+            ssize_t ret = read(fd, dst + n * stride, stride);
+            if (ret < 0 && errno != EAGAIN)
+                return n > 0 ? n : -errno;
+            if (ret <= 0)
+                break;
+            sizes[n] = ret;
+        }
+        return n;
+    };
+    func.poll_fd = fd;
+    func.pollable = true;
+    return func;
+}
+
+void VirtualController::SetData(const ControllerData &data) {
+    std::lock_guard<std::mutex> lock(lock_);
+    data_ = data;
+}
+
+void VirtualController::ReadFlash(uint32_t address, void *data, size_t size) const {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (address < FLASH_MEM_SIZE && size <= FLASH_MEM_SIZE - address)
+        memcpy(data, flash_.data() + address, size);
+}
+
+void VirtualController::GetStats(VirtualStats &stats) const {
+    std::lock_guard<std::mutex> lock(lock_);
+    stats = stats_;
+}
+
+uint8_t VirtualController::mode() const {
+    std::lock_guard<std::mutex> lock(lock_);
+    return mode_;
+}
+
+uint8_t VirtualController::player() const {
+    std::lock_guard<std::mutex> lock(lock_);
+    return player_;
+}
+
+uint8_t VirtualController::mcu_mode() const {
+    std::lock_guard<std::mutex> lock(lock_);
+    return mcu_mode_;
+}
+
+// the remote end is non-blocking, reports are dropped like over the air if nobody reads
+inline int VirtualController::Send(const InputReport &report, size_t size) {
+    if (write(fds_[1], &report, size) < 0) {
+        debug("drop report %02x, error %d", report.id, errno);
+        return -errno;
+    }
+    return 0;
+}
+
+inline void VirtualController::Header(InputReport &report, uint8_t id) {
+    bzero(&report, sizeof(report));
+    report.id = id;
+    report.timer = timer_++;
+    report.controller_state.power = SELF;
+    report.controller_state.category = category_ == JOYCON ? PRO_GRIP : category_;
+    report.controller_state.battery = BATT_FULL;
+    report.controller_data = data_;
+    report.vib_ack = vibration_ ? 0x80 : 0x00;
+}
+
+// three samples 5 ms apart, the controller lies flat and slowly rocks around X
+inline void VirtualController::Imu(ImuData &imu) {
+    if (!imu_)
+        return;
+    accelerator_t *acc[] = {&imu.acc_0, &imu.acc_1, &imu.acc_2};
+    gyroscope_t *gyro[] = {&imu.gyro_0, &imu.gyro_1, &imu.gyro_2};
+    for (int i = 0; i < 3; ++i) {
+        float phase = static_cast<float>(samples_++ % 200) * 2 * M_PI / 200;
+        acc[i]->X = 0;
+        acc[i]->Y = static_cast<int16_t>(1024 * sinf(phase));
+        acc[i]->Z = 4096;
+        gyro[i]->X = static_cast<int16_t>(1000 * cosf(phase));
+        gyro[i]->Y = 0;
+        gyro[i]->Z = 0;
+    }
+}
+
+inline void VirtualController::Reply(uint8_t ack, uint8_t id, const void *data, size_t size) {
+    InputReport report;
+    Header(report, 0x21);
+    report.reply.subcmd_ack = ack;
+    report.reply.subcmd_id = id;
+    if (data)
+        memcpy(report.reply.data, data, size);
+    Send(report, INPUT_REPORT_STAND_SIZE);
+}
+
+void VirtualController::Subcmd(const OutputReport &output) {
+    uint8_t data[sizeof(ReplyData::data)] = {};
+    uint8_t cmd = output.subcmd.cmd;
+    const uint8_t *raw = output.subcmd.raw;
+    uint32_t address = 0;
+    uint8_t length = 0;
+    switch (cmd) {
+    case SUBCMD_01:
+        data[0] = 0x03;
+        return Reply(0x81, cmd, data, 1);
+    case SUBCMD_02:
+        data[0] = VIRTUAL_FIRMWARE >> 8;
+        data[1] = VIRTUAL_FIRMWARE & 0xff;
+        data[2] = flash_[FLASH_ADDR_DEVICE_TYPE];
+        data[3] = 0x02;
+        for (int i = 0; i < FLASH_ADDR_MAC_LEN; ++i)
+            data[4 + i] = flash_[FLASH_ADDR_MAC_LE + FLASH_ADDR_MAC_LEN - 1 - i];
+        data[10] = 0x01;
+        data[11] = 0x01;
+        return Reply(0x82, cmd, data, 12);
+    case SUBCMD_03:
+        mode_ = raw[0];
+        break;
+    case SUBCMD_04:
+        return Reply(0x83, cmd, data, 2);
+    case SUBCMD_08:
+        low_power_ = raw[0] != 0;
+        break;
+    case SUBCMD_10:
+        memcpy(&address, raw, sizeof(address));
+        length = raw[4];
+        if (!assert_flash_mem_address(address) || length > FLASH_MEM_STEP || address + length > FLASH_MEM_SIZE)
+            length = 0;
+        memcpy(data, raw, 4);
+        data[4] = length;
+        memcpy(data + 5, flash_.data() + address, length);
+        return Reply(0x90, cmd, data, 5 + length);
+    case SUBCMD_11:
+        memcpy(&address, raw, sizeof(address));
+        length = raw[4];
+        data[0] = 0x01;
+        if (address < FLASH_MEM_SIZE && length <= FLASH_MEM_STEP && address + length <= FLASH_MEM_SIZE) {
+            memcpy(flash_.data() + address, raw + 5, length);
+            data[0] = 0x00;
+        }
+        return Reply(0x80, cmd, data, 1);
+    case SUBCMD_12:
+        memcpy(&address, raw, sizeof(address));
+        data[0] = 0x01;
+        if (address < FLASH_MEM_SIZE) {
+            address &= ~(FLASH_SECTOR - 1);
+            memset(flash_.data() + address, 0xff, FLASH_SECTOR);
+            data[0] = 0x00;
+        }
+        return Reply(0x80, cmd, data, 1);
+    case SUBCMD_21:
+        // reports the MCU as it was before the command
+        data[0] = 0x01;
+        data[3] = MCU_MAJOR >> 8;
+        data[4] = MCU_MAJOR & 0xff;
+        data[5] = MCU_MINOR >> 8;
+        data[6] = MCU_MINOR & 0xff;
+        data[7] = mcu_mode_;
+        if (raw[0] == MCU_CMD_SET_MODE && mcu_state_ == MCU_STATE_RESUME) {
+            mcu_mode_ = raw[2];
+        } else if (raw[0] == MCU_CMD_WRITE && raw[1] == MCU_SET_IR_MODE) {
+            ir_mode_ = raw[2];
+            ir_fragments_ = raw[3];
+            ir_fragment_ = 0;
+            ir_sent_ = false;
+            bzero(data, sizeof(data));
+            data[0] = 0x0b;
+        } else if (raw[0] == MCU_CMD_WRITE && raw[1] == MCU_SET_IR_REG) {
+            bzero(data, sizeof(data));
+            data[0] = 0x13;
+        }
+        return Reply(0xa0, cmd, data, sizeof(data));
+    case SUBCMD_22:
+        mcu_state_ = raw[0];
+        mcu_mode_ = mcu_state_ == MCU_STATE_RESUME ? MCU_MODE_STANDBY : 0;
+        ir_mode_ = IR_MODE_NONE;
+        break;
+    case SUBCMD_30:
+        player_ = raw[0];
+        break;
+    case SUBCMD_40:
+        imu_ = raw[0] != 0;
+        break;
+    case SUBCMD_48:
+        vibration_ = raw[0] != 0;
+        break;
+    case SUBCMD_50:
+        put16(data, 0x0618); // 1.56 V
+        return Reply(0xd0, cmd, data, 2);
+    default:
+        // 0x38 home light, 0x41 imu sensitivity and the unknown ones are just acked
+        break;
+    }
+    Reply(0x80, cmd, nullptr, 0);
+}
+
+// ir fragment `index` of the current frame in a 0x31 report
+inline void VirtualController::Fragment(uint8_t index) {
+    InputReport report;
+    Header(report, 0x31);
+    Imu(report.imu);
+    report.ir[0] = 0x03;
+    report.ir[3] = index;
+    for (size_t i = 0; i < IR_FRAGMENT_SIZE; ++i)
+        report.ir[10 + i] = Pixel(ir_frame_, index * IR_FRAGMENT_SIZE + i);
+    ir_fragment_ = index;
+    ir_sent_ = true;
+    stats_.fragments++;
+    Send(report, INPUT_REPORT_LARGE_SIZE);
+}
+
+// 0x11 requests to the MCU, answered with 0x31 reports
+void VirtualController::Mcu(const OutputReport &output) {
+    const uint8_t *raw = output.subcmd.raw;
+    InputReport report;
+    if (output.subcmd.cmd == SUBCMD_03 && raw[0] == POLL_NFC_IR_CAM && ir_mode_ == IR_MODE_IMG_TRANSFER) {
+        if (raw[1] == 0x01) {
+            // the host missed fragment raw[2]
+            Fragment(raw[2]);
+        } else if (ir_sent_ && raw[3] == ir_fragment_) {
+            // acked, the fragment after the last one starts the next frame
+            if (ir_fragment_ >= ir_fragments_) {
+                ir_frame_++;
+                Fragment(0);
+            } else {
+                Fragment(ir_fragment_ + 1);
+            }
+        } else {
+            Fragment(ir_fragment_);
+        }
+        return;
+    }
+    Header(report, 0x31);
+    Imu(report.imu);
+    report.ir[0] = 0xff;
+    if (mcu_state_ == MCU_STATE_RESUME) {
+        if (output.subcmd.cmd == 0x01) {
+            report.ir[0] = 0x01;
+            report.ir[3] = MCU_MAJOR >> 8;
+            report.ir[4] = MCU_MAJOR & 0xff;
+            report.ir[5] = MCU_MINOR >> 8;
+            report.ir[6] = MCU_MINOR & 0xff;
+            report.ir[7] = mcu_mode_;
+        } else if (output.subcmd.cmd == SUBCMD_03 && raw[0] == POLL_NFC_IR_DATA) {
+            report.ir[0] = 0x13;
+            report.ir[2] = ir_mode_;
+        }
+    }
+    Send(report, INPUT_REPORT_LARGE_SIZE);
+}
+
+ssize_t VirtualController::Handle(const void *buffer, size_t size) {
+    OutputReport output;
+    bzero(&output, sizeof(output));
+    memcpy(&output, buffer, size < sizeof(output) ? size : sizeof(output));
+    std::lock_guard<std::mutex> lock(lock_);
+    switch (output.id) {
+    case OUTPUT_REPORT_CMD:
+        stats_.subcmds++;
+        Subcmd(output);
+        break;
+    case OUTPUT_REPORT_RUM:
+        stats_.rumbles++;
+        break;
+    case OUTPUT_REPORT_PHL:
+        stats_.mcu++;
+        Mcu(output);
+        break;
+    default:
+        debug("unknown output report %02x", output.id);
+        break;
+    }
+    return size;
+}
+
+// Streams a report each period in the 0x30 and 0x31 modes. While an IR frame is being sent the
+// last fragment is repeated, like the camera does when the host does not ack in time.
+void *VirtualController::Stream() {
+    struct pollfd fds[2] = {
+        {.fd = stop_fd_, .events = POLLIN, .revents = 0},
+        {.fd = timer_fd_, .events = POLLIN, .revents = 0},
+    };
+    uint64_t ticks = 0;
+    InputReport report;
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            debug("poll error %d", errno);
+            break;
+        }
+        if (fds[0].revents)
+            break;
+        if (read(timer_fd_, &ticks, sizeof(ticks)) < 0)
+            continue;
+        std::lock_guard<std::mutex> lock(lock_);
+        if (mode_ == POLL_STANDARD) {
+            Header(report, 0x30);
+            Imu(report.imu);
+            Send(report, INPUT_REPORT_STAND_SIZE);
+        } else if (mode_ == POLL_NFC_IR && ir_mode_ == IR_MODE_IMG_TRANSFER && ir_sent_) {
+            Fragment(ir_fragment_);
+        } else if (mode_ == POLL_NFC_IR) {
+            Header(report, 0x31);
+            Imu(report.imu);
+            report.ir[0] = 0xff;
+            Send(report, INPUT_REPORT_LARGE_SIZE);
+        } else {
+            continue;
+        }
+        stats_.streamed++;
+    }
+    return NULL;
+}
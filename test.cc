@@ -15,16 +15,53 @@
  *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include "capture.h"
 #include "controller.h"
+#include "hidraw.h"
+#ifdef WITH_HIDAPI
+#include "hidapi_controller.h"
+#endif
 #include "log.h"
+#include "manager.h"
+#include "report_decoder.h"
 #include "session2.h"
+#include "virtual_device.h"
 #include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <iostream>
+#include <poll.h>
 #include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <termios.h>
 #include <unistd.h>
 
 #define msleep(ms) std::this_thread::sleep_for(std::chrono::milliseconds((ms)))
 
+// assert() for expressions doing the work under test, kept under NDEBUG
+#define check(expr)                                                                                    \
+    do {                                                                                               \
+        if (!(expr)) {                                                                                 \
+            fprintf(stderr, "%s:%d: %s: check `%s' failed.\n", __FILE__, __LINE__, __func__, #expr);   \
+            abort();                                                                                   \
+        }                                                                                              \
+    } while (0)
+
+// count heap allocations of the whole process
+static std::atomic<size_t> alloc_count(0);
+
+void *operator new(size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
 std::future<int> test_future() {
     std::promise<int> p;
     auto f = p.get_future();
@@ -78,6 +115,8 @@ static int test_session() {
             return size;
         },
         .recver = [](void *buffer, size_t size) -> ssize_t {
+            // a report every ms, as a device would send
+            msleep(1);
             strcpy(reinterpret_cast<char *>(buffer), "test_session");
             return size;
         },
@@ -93,11 +132,11 @@ static int test_session() {
             for (int i = 0; i < 10; i++) {
                 log_d(__func__, "time test %d -----ing", i);
                 auto f = sess.Transmit(
-                    5, buffer, [](const void *input) {
+                    5, buffer, session::Route(), [](const void *input) {
                         //hex_dump("RECV", input, INPUT_PACKET_STAND_SIZE);
                         return session::WAITING;
                     });
-                assert(f.get() == session::TIMEDOUT);
+                check(f.Get() == session::TIMEDOUT);
                 log_d(__func__, "time test %d -----OK", i);
             }
             log_d(__func__, "time test over");
@@ -109,11 +148,11 @@ static int test_session() {
             for (int i = 0; i < 10; i++) {
                 log_d(__func__, "done test %d -----ing", i);
                 auto f = sess.Transmit(
-                    5, buffer, [](const void *input) {
+                    1000, buffer, session::Route(), [](const void *input) {
                         //hex_dump("RECV", input, INPUT_PACKET_STAND_SIZE);
                         return session::DONE;
                     });
-                assert(f.get() == session::DONE);
+                check(f.Get() == session::DONE);
                 log_d(__func__, "done test %d -----OK", i);
             }
             log_d(__func__, "done test over");
@@ -125,6 +164,1301 @@ static int test_session() {
     return ret;
 }
 
+static int test_route() {
+    int ret = 0;
+    DeviceFunc dev_fun = {
+        .sender = [](const void *buffer, size_t size) -> ssize_t {
+            return size;
+        },
+        .recver = [](void *buffer, size_t size) -> ssize_t {
+            static uint8_t count = 0;
+            auto report = reinterpret_cast<InputReport *>(buffer);
+            bzero(buffer, size);
+            // one reply of SetPlayer in every 4 reports
+            if (++count % 4 == 0) {
+                report->id = 0x21;
+                report->reply.subcmd_id = SUBCMD_30;
+            } else {
+                report->id = 0x30;
+            }
+            msleep(1);
+            return size;
+        },
+        .send_size = OUTPUT_REPORT_SIZE,
+        .recv_size = INPUT_REPORT_STAND_SIZE,
+    };
+
+    session::Session sess(&dev_fun);
+    for (int i = 0; i < 10; i++) {
+        auto f = sess.Transmit(
+            50, nullptr, session::Route(0x21, SUBCMD_30), [](const void *input) {
+                auto buffer = static_cast<const InputReport *>(input);
+                assert(buffer->id == 0x21 && buffer->reply.subcmd_id == SUBCMD_30);
+                return session::DONE;
+            });
+        check(f.Get() == session::DONE);
+        f = sess.Transmit(
+            10, nullptr, session::Route(0x21, SUBCMD_40), [](const void *input) {
+                assert(false);
+                return session::DONE;
+            });
+        check(f.Get() == session::TIMEDOUT);
+    }
+    // received reports stay readable in the ring until overwritten
+    InputReport report;
+    uint64_t head = sess.Head();
+    assert(head > session::RING_SLOTS);
+    check(sess.Read(head - 1, &report, sizeof(report)) == INPUT_REPORT_STAND_SIZE);
+    assert(report.id == 0x21 || report.id == 0x30);
+    check(sess.Read(head + 1, &report, sizeof(report)) == -EAGAIN);
+    check(sess.Read(0, &report, sizeof(report)) == -EOVERFLOW);
+    // every task and report is counted
+    // (the poll thread keeps receiving, give it a tick to sweep the last timed out task)
+    static session::SessionStats stats;
+    msleep(5);
+    sess.GetStats(stats);
+    assert(stats.done == 10 && stats.timeouts == 10);
+    assert(stats.reports[0x21] + stats.reports[0x30] - stats.received <= 1);
+    const session::Histogram &rtt = stats.rtt[SUBCMD_30];
+    uint64_t count = 0;
+    for (uint64_t n : rtt.buckets)
+        count += n;
+    assert(rtt.count == 10 && count == 10 && rtt.max < 50000);
+    log_d(__func__, "%lu reports, SetPlayer rtt avg %lu us max %lu us", stats.received, rtt.sum / rtt.count, rtt.max);
+    log_d(__func__, "route test over");
+    return ret;
+}
+
+static int test_alloc() {
+    int ret = 0;
+    static std::atomic<int> subcmd(-1);
+    const Device dev = {
+        .desc = {
+            .role = CONSOLE,
+            .name = "Nintendo Switch",
+            .mac_address = "DC:68:EB:15:9A:62",
+            .serial_number = "",
+        },
+        .func = {
+            .sender = [](const void *buffer, size_t size) -> ssize_t {
+                auto report = reinterpret_cast<const OutputReport *>(buffer);
+                if (report->id == OUTPUT_REPORT_CMD)
+                    subcmd = report->subcmd.cmd;
+                return size;
+            },
+            .recver = [](void *buffer, size_t size) -> ssize_t {
+                auto report = reinterpret_cast<InputReport *>(buffer);
+                int id = subcmd.exchange(-1);
+                bzero(buffer, size);
+                if (id >= 0) {
+                    report->id = 0x21;
+                    report->reply.subcmd_id = id;
+                } else {
+                    report->id = 0x30;
+                }
+                msleep(1);
+                return size;
+            },
+            .send_size = OUTPUT_REPORT_SIZE,
+            .recv_size = INPUT_REPORT_STAND_SIZE,
+        },
+    };
+    controller::JoyCon_L jc(dev);
+    // warm up task pool and stdio buffers
+    for (int i = 0; i < 4; i++) {
+        ret = jc.SetPlayer(PLAYER_1, PLAYER_FLASH_0);
+        assert(ret == session::DONE);
+    }
+    size_t count = alloc_count;
+    for (int i = 0; i < 100; i++) {
+        ret = jc.SetPlayer(Player_(i % 5), PLAYER_FLASH_0);
+        assert(ret == session::DONE);
+        ret = jc.SetImu(i % 2);
+        assert(ret == session::DONE);
+    }
+    log_d(__func__, "%zu allocations in 200 commands", alloc_count - count);
+    assert(alloc_count == count);
+    log_d(__func__, "alloc test over");
+    return ret;
+}
+
+static int test_push() {
+    int ret = 0;
+    // reports seen by the device, id, subcmd and first rumble byte
+    static uint8_t sent[256][3];
+    static std::atomic<unsigned> count(0);
+    DeviceFunc dev_fun = {
+        .sender = [](const void *buffer, size_t size) -> ssize_t {
+            auto report = reinterpret_cast<const OutputReport *>(buffer);
+            unsigned i = count.load();
+            if (i < 256) {
+                sent[i][0] = report->id;
+                sent[i][1] = report->subcmd.cmd;
+                sent[i][2] = report->rumble.raw[0];
+                count = i + 1;
+            }
+            return size;
+        },
+        .recver = nullptr,
+        .send_size = OUTPUT_REPORT_SIZE,
+        .recv_size = 0,
+    };
+
+    session::Session sess(&dev_fun, session::TIMED, session::PUSH_PERIOD_5MS);
+    OutputReport output;
+    bzero(&output, sizeof(output));
+    output.id = OUTPUT_REPORT_RUM;
+    output.rumble.raw[0] = 0x5a;
+    uint64_t begin = monotonic_ns();
+    check(sess.Transmit(0, &output, session::Route(), nullptr).Get() == session::DONE);
+    const uint8_t subcmds[] = {SUBCMD_30, SUBCMD_40, SUBCMD_48};
+    for (uint8_t subcmd : subcmds) {
+        bzero(&output, sizeof(output));
+        output.id = OUTPUT_REPORT_CMD;
+        output.subcmd.cmd = subcmd;
+        check(sess.Transmit(0, &output, session::Route(), nullptr).Get() == session::DONE);
+    }
+    // callers only queue reports
+    assert(monotonic_ns() - begin < 5000000);
+    msleep(100);
+    // one subcmd per report in order, all carrying the latest rumble
+    unsigned n = count, next = 0;
+    assert(n >= 10);
+    for (unsigned i = 0; i < n; i++) {
+        assert(sent[i][2] == 0x5a);
+        if (sent[i][0] == OUTPUT_REPORT_CMD) {
+            assert(next < 3 && sent[i][1] == subcmds[next]);
+            next++;
+        } else {
+            assert(sent[i][0] == OUTPUT_REPORT_RUM);
+        }
+    }
+    assert(next == 3);
+    // a full queue is reported instead of blocking
+    uint64_t busy = 0;
+    for (unsigned i = 0; i < 2 * session::PUSH_QUEUE_SLOTS; i++)
+        if (sess.Transmit(0, &output, session::Route(), nullptr).Get() == session::AGAIN)
+            busy++;
+    assert(busy > 0);
+    auto stats = sess.GetPushStats();
+    log_d(__func__, "%lu reports, period %lu/%lu/%lu us, late %lu/%lu us, missed %lu", stats.reports,
+          stats.period_min / 1000, stats.period_avg / 1000, stats.period_max / 1000, stats.late_avg / 1000,
+          stats.late_max / 1000, stats.missed);
+    assert(stats.dropped == busy);
+    assert(stats.period_avg > 4000000 && stats.period_avg < 6000000);
+    log_d(__func__, "push test over");
+    return ret;
+}
+
+static int test_queued() {
+    // a stalled device, 2 ms per report
+    static std::atomic<unsigned> count(0);
+    DeviceFunc dev_fun = {
+        .sender = [](const void *buffer, size_t size) -> ssize_t {
+            msleep(2);
+            count++;
+            return size;
+        },
+        .recver = nullptr,
+        .send_size = OUTPUT_REPORT_SIZE,
+        .recv_size = 0,
+    };
+    session::Session sess(&dev_fun, session::QUEUED);
+    OutputReport output;
+    bzero(&output, sizeof(output));
+    output.id = OUTPUT_REPORT_RUM;
+    // callers only queue reports
+    uint64_t begin = monotonic_ns();
+    for (unsigned i = 0; i < 8; i++)
+        check(sess.Transmit(0, &output, session::Route(), nullptr).Get() == session::DONE);
+    assert(monotonic_ns() - begin < 2000000);
+    msleep(50);
+    assert(count == 8);
+    // a full queue is reported instead of blocking
+    uint64_t busy = 0;
+    for (unsigned i = 0; i < 2 * session::SEND_QUEUE_SLOTS; i++)
+        if (sess.Transmit(0, &output, session::Route(), nullptr).Get() == session::AGAIN)
+            busy++;
+    assert(busy > 0);
+    auto stats = sess.GetPushStats();
+    assert(stats.dropped == busy && stats.depth_max == session::SEND_QUEUE_SLOTS);
+    msleep(200);
+    stats = sess.GetPushStats();
+    log_d(__func__, "%lu reports, dropped %lu, depth %lu/%lu", stats.reports, stats.dropped, stats.depth,
+          stats.depth_max);
+    assert(stats.depth == 0 && stats.reports == count);
+    assert(count == 8 + 2 * session::SEND_QUEUE_SLOTS - busy);
+    // a device without a sender has no queue to push from
+    DeviceFunc mute_fun = {
+        .sender = nullptr,
+        .recver = nullptr,
+        .send_size = OUTPUT_REPORT_SIZE,
+        .recv_size = 0,
+    };
+    for (auto type : {session::TIMED, session::QUEUED}) {
+        session::Session mute(&mute_fun, type);
+        check(mute.Transmit(0, &output, session::Route(), nullptr).Get() == session::ERROR);
+    }
+    log_d(__func__, "queued test over");
+    return 0;
+}
+
+static int test_link() {
+    static std::atomic<bool> broken(false);
+    static std::atomic<unsigned> recvs(0);
+    DeviceFunc dev_fun = {
+        .sender = [](const void *buffer, size_t size) -> ssize_t { return size; },
+        .recver = [](void *buffer, size_t size) -> ssize_t {
+            msleep(1);
+            recvs++;
+            if (broken)
+                return -EIO;
+            bzero(buffer, size);
+            reinterpret_cast<uint8_t *>(buffer)[0] = 0x30;
+            return size;
+        },
+        .send_size = OUTPUT_REPORT_SIZE,
+        .recv_size = INPUT_REPORT_STAND_SIZE,
+    };
+    static std::mutex lock;
+    static std::vector<session::LinkState> changes;
+    session::Session sess(&dev_fun);
+    sess.SetLinkCallback([](session::LinkState from, session::LinkState to) {
+        std::lock_guard<std::mutex> _1(lock);
+        changes.push_back(to);
+    });
+    OutputReport output;
+    bzero(&output, sizeof(output));
+    output.id = OUTPUT_REPORT_CMD;
+    msleep(20);
+    assert(sess.GetLinkState() == session::LINK_HEALTHY);
+    // a task waiting on a link going down fails long before its timeout
+    auto pending = sess.Transmit(2000, nullptr, session::Route(0x21, SUBCMD_48), [](const void *) { return 0; });
+    uint64_t begin = monotonic_ns();
+    broken = true;
+    check(pending.Get() == session::LOST);
+    assert(monotonic_ns() - begin < 200000000);
+    assert(sess.GetLinkState() == session::LINK_LOST);
+    // and new ones fail at once
+    begin = monotonic_ns();
+    auto f = sess.Transmit(2000, &output, session::Route(0x21, SUBCMD_48), [](const void *) { return 0; });
+    check(f.Get() == session::LOST);
+    assert(monotonic_ns() - begin < 1000000);
+    // a device taking writes but not answering does not recover
+    for (int i = 0; i < 2 * session::LINK_RECOVER_REPORTS; i++)
+        check(sess.Transmit(0, &output, session::Route(), nullptr).Get() == session::DONE);
+    assert(sess.GetLinkState() == session::LINK_LOST);
+    // the timer is stamped on a copy, the caller's report is left as it was
+    assert(output.timer == 0);
+    // the poll thread backs off instead of spinning on errors
+    unsigned before = recvs;
+    msleep(500);
+    assert(recvs - before < 20);
+    broken = false;
+    msleep(400);
+    assert(sess.GetLinkState() == session::LINK_HEALTHY);
+    {
+        std::lock_guard<std::mutex> _1(lock);
+        const session::LinkState expect[] = {session::LINK_DEGRADED, session::LINK_LOST, session::LINK_RECOVERING,
+                                             session::LINK_HEALTHY};
+        assert(changes.size() == 4);
+        for (unsigned i = 0; i < 4; ++i)
+            assert(changes[i] == expect[i]);
+    }
+    check(sess.Transmit(0, &output, session::Route(), nullptr).Get() == session::DONE);
+    log_d(__func__, "link test over");
+    return 0;
+}
+
+static int test_pipeline() {
+    int ret = 0;
+    // the device answers every subcmd 10 ms after it was sent
+    static const uint64_t rtt = 10000000;
+    static struct {
+        uint8_t id;
+        uint64_t time;
+    } sent[64];
+    static std::atomic<unsigned> head(0), tail(0);
+    const Device dev = {
+        .desc = {
+            .role = CONSOLE,
+            .name = "Nintendo Switch",
+            .mac_address = "DC:68:EB:15:9A:62",
+            .serial_number = "",
+        },
+        .func = {
+            .sender = [](const void *buffer, size_t size) -> ssize_t {
+                auto report = reinterpret_cast<const OutputReport *>(buffer);
+                if (report->id == OUTPUT_REPORT_CMD) {
+                    unsigned i = head.load();
+                    sent[i % 64] = {report->subcmd.cmd, monotonic_ns()};
+                    head = i + 1;
+                }
+                return size;
+            },
+            .recver = [](void *buffer, size_t size) -> ssize_t {
+                auto report = reinterpret_cast<InputReport *>(buffer);
+                unsigned i = tail.load();
+                bzero(buffer, size);
+                report->id = 0x30;
+                if (i != head.load() && monotonic_ns() >= sent[i % 64].time + rtt) {
+                    report->id = 0x21;
+                    report->reply.subcmd_id = sent[i % 64].id;
+                    tail = i + 1;
+                }
+                msleep(1);
+                return size;
+            },
+            .send_size = OUTPUT_REPORT_SIZE,
+            .recv_size = INPUT_REPORT_STAND_SIZE,
+        },
+    };
+    controller::JoyCon_L jc(dev);
+    // one round trip after another
+    uint64_t begin = monotonic_ns();
+    check(jc.SetLowPower(false) == session::DONE);
+    check(jc.SetImu(true) == session::DONE);
+    check(jc.SetRumble(true) == session::DONE);
+    check(jc.SetPlayer(PLAYER_1, PLAYER_FLASH_0) == session::DONE);
+    uint64_t serial = monotonic_ns() - begin;
+    // all in flight together
+    begin = monotonic_ns();
+    check(jc.Begin(4) == session::DONE);
+    check(jc.SetLowPower(false) == session::WAITING);
+    check(jc.SetImu(true) == session::WAITING);
+    check(jc.SetRumble(true) == session::WAITING);
+    check(jc.SetPlayer(PLAYER_1, PLAYER_FLASH_0) == session::WAITING);
+    check(jc.Commit() == session::DONE);
+    uint64_t pipelined = monotonic_ns() - begin;
+    // a second command with the same reply waits for the first
+    begin = monotonic_ns();
+    check(jc.Begin(4) == session::DONE);
+    jc.SetPlayer(PLAYER_1, PLAYER_FLASH_0);
+    jc.SetPlayer(PLAYER_2, PLAYER_FLASH_0);
+    check(jc.Commit() == session::DONE);
+    uint64_t same = monotonic_ns() - begin;
+    log_d(__func__, "serial %lu us, pipelined %lu us, same subcmd %lu us", serial / 1000, pipelined / 1000,
+          same / 1000);
+    assert(serial >= 4 * rtt);
+    assert(pipelined < 2 * rtt);
+    assert(same >= 2 * rtt);
+    log_d(__func__, "pipeline test over");
+    return ret;
+}
+
+static int test_batch() {
+    int ret = 0;
+    static std::atomic<unsigned> calls(0);
+    DeviceFunc dev_fun = {
+        .sender = [](const void *buffer, size_t size) -> ssize_t {
+            return size;
+        },
+        .recver = nullptr,
+        .send_size = OUTPUT_REPORT_SIZE,
+        .recv_size = INPUT_REPORT_STAND_SIZE,
+        // up to 4 reports are queued at each call, the last one replies SetPlayer
+        .batch_recver = [](void *buffer, size_t stride, size_t count, size_t *sizes) -> ssize_t {
+            size_t n = count < 4 ? count : 4;
+            for (size_t i = 0; i < n; ++i) {
+                auto report = reinterpret_cast<InputReport *>(static_cast<uint8_t *>(buffer) + i * stride);
+                bzero(report, stride);
+                report->id = 0x30;
+                sizes[i] = stride;
+            }
+            if (n == 4) {
+                auto report = reinterpret_cast<InputReport *>(static_cast<uint8_t *>(buffer) + 3 * stride);
+                report->id = 0x21;
+                report->reply.subcmd_id = SUBCMD_30;
+            }
+            calls++;
+            msleep(1);
+            return n;
+        },
+    };
+
+    session::Session sess(&dev_fun);
+    for (int i = 0; i < 10; i++) {
+        auto f = sess.Transmit(
+            50, nullptr, session::Route(0x21, SUBCMD_30), [](const void *input) {
+                auto buffer = static_cast<const InputReport *>(input);
+                assert(buffer->id == 0x21 && buffer->reply.subcmd_id == SUBCMD_30);
+                return session::DONE;
+            });
+        check(f.Get() == session::DONE);
+    }
+    // batches are published in order and wrap around the ring
+    InputReport report;
+    uint64_t head = sess.Head();
+    assert(head > session::RING_SLOTS);
+    for (uint64_t seq = head - session::RING_SLOTS / 2; seq < head; ++seq) {
+        check(sess.Read(seq, &report, sizeof(report)) == INPUT_REPORT_STAND_SIZE);
+        assert(report.id == (seq % 4 == 3 ? 0x21 : 0x30));
+    }
+    static session::SessionStats stats;
+    sess.GetStats(stats);
+    log_d(__func__, "%lu reports in %u calls", stats.received, calls.load());
+    assert(stats.received > 3 * (calls - 1));
+    log_d(__func__, "batch test over");
+    return ret;
+}
+
+static int test_teardown() {
+    int ret = 0;
+    int sv[2], bv[2];
+    ret = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv);
+    assert(ret == 0);
+    ret = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, bv);
+    assert(ret == 0);
+    // a silent device, reports would arrive on sv[0]
+    DeviceFunc pollable = {
+        .sender = [](const void *buffer, size_t size) -> ssize_t {
+            return size;
+        },
+        .recver = [sv](void *buffer, size_t size) -> ssize_t {
+            return read(sv[0], buffer, size);
+        },
+        .send_size = OUTPUT_REPORT_SIZE,
+        .recv_size = INPUT_REPORT_STAND_SIZE,
+        .batch_recver = nullptr,
+        .poll_fd = sv[0],
+        .pollable = true,
+    };
+    // a silent device with a blocking recver and a waker
+    DeviceFunc blocking = {
+        .sender = [](const void *buffer, size_t size) -> ssize_t {
+            return size;
+        },
+        .recver = [bv](void *buffer, size_t size) -> ssize_t {
+            return read(bv[0], buffer, size);
+        },
+        .send_size = OUTPUT_REPORT_SIZE,
+        .recv_size = INPUT_REPORT_STAND_SIZE,
+        .batch_recver = nullptr,
+        .waker = [bv]() {
+            shutdown(bv[1], SHUT_WR);
+        },
+    };
+    for (const DeviceFunc *dev : {&pollable, &blocking}) {
+        std::unique_ptr<session::Session> sess(new session::Session(dev, session::TIMED, session::PUSH_PERIOD_15MS));
+        // the pending task is aborted, its Future outlives the session
+        auto f = sess->Transmit(1000, nullptr, session::Route(0x21, SUBCMD_30), [](const void *input) {
+            return session::WAITING;
+        });
+        auto waiter = std::async(std::launch::async, [](session::Future f) {
+            msleep(20);
+            return f.Get();
+        }, std::move(f));
+        uint64_t begin = monotonic_ns();
+        sess.reset();
+        uint64_t cost = monotonic_ns() - begin;
+        check(waiter.get() == session::ABORT);
+        log_d(__func__, "session stopped in %lu us", cost / 1000);
+        assert(cost < 20000000);
+    }
+    close(sv[0]);
+    close(sv[1]);
+    close(bv[0]);
+    close(bv[1]);
+    log_d(__func__, "teardown test over");
+    return ret;
+}
+
+static int threads() {
+    int n = 0;
+    DIR *dir = opendir("/proc/self/task");
+    while (dir && readdir(dir))
+        n++;
+    if (dir)
+        closedir(dir);
+    return n - 2;
+}
+
+static int test_reactor() {
+    int ret = 0;
+    const int count = 8;
+    int sv[count][2];
+    static std::atomic<int> pushed(0);
+    session::Reactor reactor(2);
+    int before = threads();
+    {
+        std::vector<std::unique_ptr<session::Session>> sessions;
+        for (int i = 0; i < count; i++) {
+            ret = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv[i]);
+            assert(ret == 0);
+            int local = sv[i][0], remote = sv[i][1];
+            // the device answers each subcmd through the socket
+            DeviceFunc dev_fun = {
+                .sender = [remote](const void *buffer, size_t size) -> ssize_t {
+                    auto output = reinterpret_cast<const OutputReport *>(buffer);
+                    if (output->id == OUTPUT_REPORT_RUM) {
+                        pushed++;
+                        return size;
+                    }
+                    InputReport report;
+                    bzero(&report, sizeof(report));
+                    report.id = 0x21;
+                    report.reply.subcmd_id = output->subcmd.cmd;
+                    return write(remote, &report, INPUT_REPORT_STAND_SIZE) < 0 ? -errno : size;
+                },
+                .recver = [local](void *buffer, size_t size) -> ssize_t {
+                    return read(local, buffer, size);
+                },
+                .send_size = OUTPUT_REPORT_SIZE,
+                .recv_size = INPUT_REPORT_STAND_SIZE,
+                .batch_recver = nullptr,
+                .poll_fd = local,
+                .pollable = true,
+            };
+            // the last one pushes through the reactor too
+            auto type = i == count - 1 ? session::TIMED : session::FREE;
+            sessions.emplace_back(new session::Session(&dev_fun, &reactor, type, session::PUSH_PERIOD_5MS));
+        }
+        assert(reactor.Size() == count);
+        assert(threads() == before);
+        OutputReport output;
+        bzero(&output, sizeof(output));
+        output.id = OUTPUT_REPORT_CMD;
+        output.subcmd.cmd = SUBCMD_30;
+        for (int round = 0; round < 10; round++) {
+            std::vector<session::Future> results;
+            for (auto &sess : sessions) {
+                results.push_back(sess->Transmit(50, &output, session::Route(0x21, SUBCMD_30), [](const void *input) {
+                    return session::DONE;
+                }));
+            }
+            for (auto &f : results)
+                check(f.Get() == session::DONE);
+        }
+        // a task nobody answers still times out on the wheel ticked by the reactor
+        auto f = sessions[0]->Transmit(10, nullptr, session::Route(0x21, SUBCMD_40), [](const void *input) {
+            return session::DONE;
+        });
+        check(f.Get() == session::TIMEDOUT);
+        msleep(50);
+        static session::SessionStats stats;
+        sessions[0]->GetStats(stats);
+        assert(stats.done == 10 && stats.timeouts == 1);
+        assert(pushed > 5);
+    }
+    assert(reactor.Size() == 0);
+    for (int i = 0; i < count; i++) {
+        close(sv[i][0]);
+        close(sv[i][1]);
+    }
+    // a lost link backs off without stalling the other sessions of its loop
+    {
+        static std::atomic<unsigned> recvs(0);
+        session::Reactor single(1);
+        int always = eventfd(1, EFD_CLOEXEC);
+        DeviceFunc broken = {
+            .sender = nullptr,
+            .recver = [](void *buffer, size_t size) -> ssize_t {
+                recvs++;
+                return -EIO;
+            },
+            .send_size = OUTPUT_REPORT_SIZE,
+            .recv_size = INPUT_REPORT_STAND_SIZE,
+            .batch_recver = nullptr,
+            .poll_fd = always,
+            .pollable = true,
+        };
+        ret = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv[0]);
+        assert(ret == 0);
+        int local = sv[0][0], remote = sv[0][1];
+        DeviceFunc healthy = {
+            .sender = nullptr,
+            .recver = [local](void *buffer, size_t size) -> ssize_t { return read(local, buffer, size); },
+            .send_size = OUTPUT_REPORT_SIZE,
+            .recv_size = INPUT_REPORT_STAND_SIZE,
+            .batch_recver = nullptr,
+            .poll_fd = local,
+            .pollable = true,
+        };
+        {
+            session::Session lost(&broken, &single), sess(&healthy, &single);
+            msleep(300);
+            assert(lost.GetLinkState() == session::LINK_LOST);
+            InputReport report;
+            bzero(&report, sizeof(report));
+            report.id = 0x30;
+            session::InputState state;
+            bzero(&state, sizeof(state));
+            uint64_t worst = 0;
+            for (int i = 0; i < 20; i++) {
+                uint64_t seq = state.seq, begin = monotonic_ns();
+                check(write(remote, &report, INPUT_REPORT_STAND_SIZE) == INPUT_REPORT_STAND_SIZE);
+                check(sess.WaitState(state, seq, 200) == session::DONE);
+                worst = std::max(worst, monotonic_ns() - begin);
+                msleep(5);
+            }
+            log_d(__func__, "worst report latency beside a lost link %lu us, %u recvs", worst / 1000, recvs.load());
+            assert(worst < 20000000);
+            assert(recvs < 40);
+        }
+        close(always);
+        close(local);
+        close(remote);
+    }
+    // fd 0 is a valid poll_fd, a zeroed DeviceFunc has none and keeps its own threads
+    {
+        session::Reactor single(1);
+        ret = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv[0]);
+        assert(ret == 0);
+        int saved = dup(0);
+        check(saved >= 0 && dup2(sv[0][0], 0) == 0);
+        DeviceFunc stdin_func = {
+            .sender = nullptr,
+            .recver = [](void *buffer, size_t size) -> ssize_t { return read(0, buffer, size); },
+            .send_size = OUTPUT_REPORT_SIZE,
+            .recv_size = INPUT_REPORT_STAND_SIZE,
+            .batch_recver = nullptr,
+            .poll_fd = 0,
+            .pollable = true,
+        };
+        DeviceFunc zeroed = {};
+        zeroed.send_size = OUTPUT_REPORT_SIZE;
+        {
+            session::Session sess(&stdin_func, &single), own(&zeroed, &single);
+            assert(single.Size() == 1);
+            InputReport report;
+            bzero(&report, sizeof(report));
+            report.id = 0x30;
+            session::InputState state;
+            check(write(sv[0][1], &report, INPUT_REPORT_STAND_SIZE) == INPUT_REPORT_STAND_SIZE);
+            check(sess.WaitState(state, 0, 200) == session::DONE);
+        }
+        check(dup2(saved, 0) == 0);
+        close(saved);
+        close(sv[0][0]);
+        close(sv[0][1]);
+    }
+    log_d(__func__, "%d sessions on 2 threads, %d pushed", count, pushed.load());
+    log_d(__func__, "reactor test over");
+    return ret;
+}
+
+static void write_file(const std::string &path, const char *content) {
+    FILE *file = fopen(path.c_str(), "w");
+    assert(file);
+    fputs(content, file);
+    fclose(file);
+}
+
+static int test_hidraw() {
+    int ret = 0;
+    char root[] = "/tmp/joycon_XXXXXX";
+    check(mkdtemp(root));
+    std::string sysfs = std::string(root) + "/class", dev = std::string(root) + "/dev";
+    // a raw pty stands in for the hidraw node of a joycon, beside a mouse and a node without uevent
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    check(master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0);
+    struct termios tio;
+    tcgetattr(master, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(master, TCSANOW, &tio);
+    for (auto dir : {sysfs, dev, sysfs + "/hidraw0", sysfs + "/hidraw0/device", sysfs + "/hidraw1",
+                     sysfs + "/hidraw1/device", sysfs + "/hidraw2"})
+        check(mkdir(dir.c_str(), 0755) == 0);
+    write_file(sysfs + "/hidraw0/device/uevent",
+               "DRIVER=nintendo\nHID_ID=0005:0000057E:00002006\nHID_NAME=Joy-Con (L)\nHID_UNIQ=98:b6:e9:00:00:01\n");
+    write_file(sysfs + "/hidraw1/device/uevent", "HID_ID=0003:0000046D:0000C077\nHID_NAME=Mouse\n");
+    check(symlink(ptsname(master), (dev + "/hidraw0").c_str()) == 0);
+    auto devices = hidraw::Enumerate(sysfs.c_str(), dev.c_str());
+    assert(devices.size() == 1);
+    assert(devices[0].path == dev + "/hidraw0");
+    assert(devices[0].product == controller::JoyCon_L::PID);
+    assert(devices[0].serial == "98:b6:e9:00:00:01");
+    // the device answers each subcmd from the other end of the pty
+    std::atomic<bool> running(true);
+    std::atomic<int> answered(0);
+    std::thread device([&]() {
+        uint8_t buffer[OUTPUT_REPORT_SIZE];
+        size_t size = 0;
+        struct pollfd fds = {.fd = master, .events = POLLIN, .revents = 0};
+        while (running) {
+            if (poll(&fds, 1, 10) <= 0)
+                continue;
+            ssize_t n = read(master, buffer + size, sizeof(buffer) - size);
+            if (n <= 0)
+                continue;
+            size += n;
+            if (size < sizeof(buffer))
+                continue;
+            size = 0;
+            auto output = reinterpret_cast<const OutputReport *>(buffer);
+            if (output->id != OUTPUT_REPORT_CMD)
+                continue;
+            InputReport report;
+            bzero(&report, sizeof(report));
+            report.id = 0x21;
+            report.reply.subcmd_id = output->subcmd.cmd;
+            // counted before the reply can complete the command
+            answered++;
+            if (write(master, &report, INPUT_REPORT_STAND_SIZE) != INPUT_REPORT_STAND_SIZE)
+                answered--;
+        }
+    });
+    const Device host = {.desc = sNintendoSwitch, .func = {}};
+    {
+        controller::JoyCon_L jc(new hidraw::HidrawImpl(&host, devices));
+        check(jc.SetPlayer(PLAYER_1, PLAYER_FLASH_0) == session::DONE);
+        check(jc.SetLowPower(false) == session::DONE);
+        assert(answered == 2);
+    }
+    // no JoyCon_R among the devices
+    bool thrown = false;
+    try {
+        controller::JoyCon_R jc(new hidraw::HidrawImpl(&host, devices));
+    } catch (const std::runtime_error &e) {
+        thrown = true;
+    }
+    assert(thrown);
+    running = false;
+    device.join();
+    close(master);
+    std::string cmd = std::string("rm -rf ") + root;
+    ret = system(cmd.c_str());
+    log_d(__func__, "hidraw test over");
+    return ret;
+}
+
+static int test_virtual() {
+    int ret = 0;
+    virtual_device::VirtualController vc(JOYCON_R, 5000);
+    // standard reports, the session takes large ones whole while the ir mode is set
+    const Device dev = {.desc = sNintendoSwitch, .func = vc.Func()};
+    controller::JoyCon_R jc(dev);
+    check(jc.Pair() == session::DONE);
+    check(jc.Poll(POLL_STANDARD) == session::DONE);
+    assert(vc.mode() == POLL_STANDARD);
+    check(jc.SetImu(true) == session::DONE);
+    check(jc.SetPlayer(PLAYER_2, PLAYER_FLASH_0) == session::DONE);
+    assert(vc.player() == PLAYER_2);
+    // the flash keeps what was written
+    ControllerColor color, neon = make_controller_color(0xe6ff00, 0x142800, 0xe6ff00, 0xe6ff00);
+    check(jc.GetColor(color) == session::DONE);
+    assert(color.body_color[0] == 0xff && color.body_color[1] == 0x3c && color.body_color[2] == 0x28);
+    check(jc.SetColor(neon) == session::DONE);
+    check(jc.GetColor(color) == session::DONE);
+    assert(memcmp(&color, &neon, sizeof(color)) == 0);
+    ControllerData data;
+    bzero(&data, sizeof(data));
+    check(jc.GetData(data) == session::DONE);
+    assert(data.right_stick.X == 0x800 && data.right_stick.Y == 0x800);
+    // the poll thread keeps the latest state, read without a round trip
+    ControllerData state, pressed = data;
+    pressed.button.A = PRESSED;
+    vc.SetData(pressed);
+    check(jc.WaitState(state, 100) == session::DONE);
+    check(jc.WaitState(state, 100) == session::DONE);
+    assert(state.button.A == PRESSED && state.right_stick.X == 0x800);
+    uint64_t begin = monotonic_ns();
+    for (int i = 0; i < 1000; ++i)
+        check(jc.GetState(state) == session::DONE);
+    log_d(__func__, "GetState in %lu ns", (monotonic_ns() - begin) / 1000);
+    vc.SetData(data);
+    check(jc.WaitState(state, 100) == session::DONE);
+    check(jc.WaitState(state, 100) == session::DONE);
+    // the press and the release are both kept
+    session::ButtonEvent events[8];
+    size_t n = jc.GetButtonEvents(events, 8);
+    assert(n >= 2 && events[n - 2].pressed && events[n - 1].released == events[n - 2].pressed);
+    // sticks through the factory calibration Pair() read
+    controller::Sticks sticks;
+    pressed = data;
+    pressed.right_stick.X = 0x800 + 0x600;
+    pressed.right_stick.Y = 0x800 - 0x50;
+    vc.SetData(pressed);
+    check(jc.WaitState(state, 100) == session::DONE);
+    check(jc.WaitState(state, 100) == session::DONE);
+    check(jc.GetSticks(sticks) == session::DONE);
+    assert(sticks.right_x == controller::STICK_MAX && sticks.right_y == 0);
+    pressed.right_stick.Y = 0x800 - 0x300;
+    vc.SetData(pressed);
+    check(jc.WaitState(state, 100) == session::DONE);
+    check(jc.WaitState(state, 100) == session::DONE);
+    check(jc.GetSticks(sticks) == session::DONE);
+    assert(sticks.right_y == -(0x300 - controller::STICK_DEADZONE_DEFAULT) * controller::STICK_MAX /
+                                 (0x600 - controller::STICK_DEADZONE_DEFAULT));
+    vc.SetData(data);
+    // a blank block gives a centered stick
+    uint8_t blank[FLASH_ADDR_STICK_CALIB_LEN];
+    memset(blank, 0xff, sizeof(blank));
+    controller::StickCalibration calibration;
+    check(!calibration.Parse(blank, false));
+    assert(calibration.center[0] == 0x800 && calibration.center[1] == 0x800);
+    // flash that cannot be read leaves the nominal calibration, the pairing stands
+    {
+        virtual_device::VirtualController mute(JOYCON_L, 0);
+        DeviceFunc func = mute.Func();
+        auto sender = func.sender;
+        func.sender = [sender](const void *buffer, size_t size) -> ssize_t {
+            auto output = reinterpret_cast<const OutputReport *>(buffer);
+            if (output->id == OUTPUT_REPORT_CMD && output->subcmd.cmd == SUBCMD_10)
+                return size;
+            return sender(buffer, size);
+        };
+        const Device host = {.desc = sNintendoSwitch, .func = func};
+        controller::JoyCon_L left(host);
+        check(left.Pair() == session::DONE);
+        check(left.GetSticks(sticks) == session::DONE);
+        assert(sticks.left_x == 0 && sticks.left_y == 0);
+    }
+    // a pairing inside a pipelining window still reads the calibration
+    {
+        static std::atomic<unsigned> reads(0);
+        virtual_device::VirtualController piped(JOYCON_L, 0);
+        DeviceFunc func = piped.Func();
+        auto sender = func.sender;
+        func.sender = [sender](const void *buffer, size_t size) -> ssize_t {
+            auto output = reinterpret_cast<const OutputReport *>(buffer);
+            if (output->id == OUTPUT_REPORT_CMD && output->subcmd.cmd == SUBCMD_10)
+                reads++;
+            return sender(buffer, size);
+        };
+        const Device host = {.desc = sNintendoSwitch, .func = func};
+        controller::JoyCon_L left(host);
+        check(left.Begin(4) == session::DONE);
+        check(left.Pair() == session::DONE);
+        check(left.Commit() == session::DONE);
+        assert(reads > 0);
+    }
+    // streamed at 200 Hz with imu samples
+    msleep(100);
+    virtual_device::VirtualStats stats;
+    vc.GetStats(stats);
+    assert(stats.streamed >= 10);
+    // two 30p frames through the ir fragment protocol
+    static uint8_t image[(IR_CONFIG_FRAGMENTS_30P + 1) * IR_FRAGMENT_SIZE];
+    static int frames;
+    frames = 0;
+    ret = jc.TestIR(3, image, []() -> int {
+        frames++;
+        for (size_t i = 0; i < sizeof(image); ++i)
+            if (image[i] != virtual_device::VirtualController::Pixel(image[0] / 7, i))
+                return -1;
+        return frames >= 2 ? 1 : 0;
+    });
+    assert(ret == session::DONE);
+    assert(frames == 2);
+    assert(vc.mode() == POLL_STANDARD);
+    vc.GetStats(stats);
+    log_d(__func__, "subcmds %lu, mcu %lu, streamed %lu, fragments %lu", stats.subcmds, stats.mcu,
+          stats.streamed, stats.fragments);
+    log_d(__func__, "virtual test over");
+    return 0;
+}
+
+static int test_capture() {
+    int ret = 0;
+    char path[] = "/tmp/joycon_capture_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    // record a virtual joycon streaming for a while
+    uint64_t begin = monotonic_ns();
+    {
+        virtual_device::VirtualController vc(JOYCON_L, 2000);
+        capture::Recorder recorder(path, vc.Func());
+        const Device dev = {.desc = sNintendoSwitch, .func = recorder.Func()};
+        controller::JoyCon_L jc(dev);
+        check(jc.Poll(POLL_STANDARD) == session::DONE);
+        check(jc.SetImu(true) == session::DONE);
+        check(jc.SetPlayer(PLAYER_3, PLAYER_FLASH_0) == session::DONE);
+        msleep(100);
+    }
+    uint64_t recorded = monotonic_ns() - begin;
+    // as recorded
+    static session::SessionStats stats;
+    {
+        capture::Replay replay(path, capture::REPLAY_TIMED);
+        assert(replay.inputs() > 40);
+        auto func = replay.Func(INPUT_REPORT_STAND_SIZE);
+        begin = monotonic_ns();
+        session::Session sess(&func);
+        while (!replay.Done())
+            msleep(1);
+        uint64_t replayed = monotonic_ns() - begin;
+        msleep(5);
+        sess.GetStats(stats);
+        assert(stats.received == replay.inputs());
+        assert(stats.reports[0x21] == 3 && stats.reports[0x30] + 3 == replay.inputs());
+        assert(replayed > recorded / 2);
+        log_d(__func__, "%zu reports recorded in %lu ms, replayed in %lu ms", replay.inputs(), recorded / 1000000,
+              replayed / 1000000);
+    }
+    // as fast as the session dispatches them, 100 times over
+    {
+        uint64_t reports = 0, elapsed = 0;
+        for (int i = 0; i < 100; i++) {
+            capture::Replay replay(path, capture::REPLAY_FAST);
+            auto func = replay.Func(INPUT_REPORT_STAND_SIZE);
+            begin = monotonic_ns();
+            session::Session sess(&func);
+            while (!replay.Done())
+                std::this_thread::yield();
+            elapsed += monotonic_ns() - begin;
+            reports += replay.inputs();
+        }
+        log_d(__func__, "fast replay %lu reports in %lu us, %lu ns per report", reports, elapsed / 1000,
+              elapsed / reports);
+        assert(elapsed < recorded * 100 / 10);
+    }
+    unlink(path);
+    log_d(__func__, "capture test over");
+    return ret;
+}
+
+static int test_feed() {
+    int ret = 0;
+    // the host hands each subcmd to a callback thread, which feeds the reply back
+    static std::atomic<int> pending(-1);
+    int before = threads();
+    DeviceFunc dev_fun = {
+        .sender = [](const void *buffer, size_t size) -> ssize_t {
+            auto output = reinterpret_cast<const OutputReport *>(buffer);
+            if (output->id == OUTPUT_REPORT_CMD)
+                pending = output->subcmd.cmd;
+            return size;
+        },
+        .recver = nullptr,
+        .send_size = OUTPUT_REPORT_SIZE,
+        .recv_size = INPUT_REPORT_STAND_SIZE,
+    };
+    session::Session sess(&dev_fun);
+    assert(threads() == before);
+    std::atomic<bool> running(true);
+    std::thread callback([&]() {
+        while (running) {
+            int cmd = pending.exchange(-1);
+            if (cmd < 0) {
+                std::this_thread::yield();
+                continue;
+            }
+            InputReport report;
+            bzero(&report, sizeof(report));
+            report.id = 0x21;
+            report.reply.subcmd_id = cmd;
+            check(sess.Feed(&report, INPUT_REPORT_STAND_SIZE) == INPUT_REPORT_STAND_SIZE);
+        }
+    });
+    OutputReport output;
+    bzero(&output, sizeof(output));
+    output.id = OUTPUT_REPORT_CMD;
+    output.subcmd.cmd = SUBCMD_30;
+    for (int i = 0; i < 100; i++) {
+        auto f = sess.Transmit(50, &output, session::Route(0x21, SUBCMD_30), [](const void *input) {
+            return session::DONE;
+        });
+        check(f.Get() == session::DONE);
+    }
+    // unanswered tasks still time out with nobody feeding
+    output.subcmd.cmd = SUBCMD_40;
+    running = false;
+    callback.join();
+    auto f = sess.Transmit(10, &output, session::Route(0x21, SUBCMD_40), [](const void *input) {
+        return session::DONE;
+    });
+    check(f.Get() == session::TIMEDOUT);
+    static session::SessionStats stats;
+    sess.GetStats(stats);
+    assert(stats.received == 100 && stats.done == 100);
+    assert(sess.Head() == 100);
+    log_d(__func__, "fed rtt avg %lu us, max %lu us", stats.rtt[SUBCMD_30].sum / stats.rtt[SUBCMD_30].count,
+          stats.rtt[SUBCMD_30].max);
+    // a session reading its device does not take fed reports
+    virtual_device::VirtualController vc;
+    auto func = vc.Func();
+    session::Session reader(&func);
+    check(reader.Feed(&output, sizeof(output)) == -EINVAL);
+    log_d(__func__, "feed test over");
+    return ret;
+}
+
+static int test_buttons() {
+    DeviceFunc dev_fun = {
+        .sender = nullptr,
+        .recver = nullptr,
+        .send_size = OUTPUT_REPORT_SIZE,
+        .recv_size = INPUT_REPORT_STAND_SIZE,
+    };
+    session::Session sess(&dev_fun);
+    InputReport report;
+    bzero(&report, sizeof(report));
+    report.id = 0x30;
+    auto feed = [&](button_state_t a, button_state_t b, button_state_t x) {
+        report.controller_data.button.A = a;
+        report.controller_data.button.B = b;
+        report.controller_data.button.X = x;
+        check(sess.Feed(&report, INPUT_REPORT_STAND_SIZE) == INPUT_REPORT_STAND_SIZE);
+    };
+    // a tap shorter than any polling, then a chord released one button at a time
+    feed(PRESSED, RELEASE, RELEASE);
+    feed(RELEASE, RELEASE, RELEASE);
+    feed(RELEASE, RELEASE, RELEASE);
+    feed(RELEASE, PRESSED, PRESSED);
+    feed(RELEASE, PRESSED, RELEASE);
+    button_t a = {}, bx = {}, x = {};
+    a.A = PRESSED;
+    bx.B = bx.X = PRESSED;
+    x.X = PRESSED;
+    auto mask = [](const button_t &button) -> uint32_t {
+        return button.left | button.shared << 8 | button.right << 16;
+    };
+    const uint32_t expect[][2] = {{mask(a), 0}, {0, mask(a)}, {mask(bx), 0}, {0, mask(x)}};
+    session::ButtonEvent events[8];
+    check(sess.ReadButtonEvents(events, 8) == 4);
+    for (int i = 0; i < 4; ++i) {
+        assert(events[i].pressed == expect[i][0] && events[i].released == expect[i][1]);
+        assert(i == 0 || events[i].time >= events[i - 1].time);
+    }
+    check(sess.ReadButtonEvents(events, 8) == 0);
+    // a full ring keeps the oldest events
+    for (unsigned i = 0; i < session::BUTTON_EVENT_SLOTS + 10; ++i)
+        feed(i & 1 ? RELEASE : PRESSED, PRESSED, RELEASE);
+    size_t n = 0, got;
+    while ((got = sess.ReadButtonEvents(events, 8)) > 0) {
+        assert(events[0].pressed == (n & 1 ? 0 : mask(a)));
+        n += got;
+    }
+    assert(n == session::BUTTON_EVENT_SLOTS && sess.ButtonEventsDropped() == 10);
+    log_d(__func__, "buttons test over");
+    return 0;
+}
+
+static int test_timer() {
+    DeviceFunc dev_fun = {
+        .sender = nullptr,
+        .recver = nullptr,
+        .send_size = OUTPUT_REPORT_SIZE,
+        .recv_size = INPUT_REPORT_STAND_SIZE,
+    };
+    session::Session sess(&dev_fun);
+    InputReport report;
+    bzero(&report, sizeof(report));
+    report.id = 0x30;
+    session::InputState state, last;
+    bzero(&last, sizeof(last));
+    // a step of 3 ticks across two wraps, with one report lost and one repeated
+    uint8_t timer = 0xf0;
+    for (int i = 0; i < 200; ++i) {
+        timer += i == 50 ? 6 : i == 100 ? 0 : 3;
+        report.timer = timer;
+        check(sess.Feed(&report, INPUT_REPORT_STAND_SIZE) == INPUT_REPORT_STAND_SIZE);
+        check(sess.GetState(state));
+        assert(state.timestamp <= state.time);
+        if (i == 100) {
+            assert(state.ticks == last.ticks && state.timestamp == last.timestamp);
+        } else if (i > 0) {
+            assert(state.ticks == last.ticks + (i == 50 ? 6 : 3));
+            assert(state.timestamp > last.timestamp);
+        }
+        last = state;
+    }
+    assert(state.ticks == 199 * 3);
+    session::SessionStats stats;
+    sess.GetStats(stats);
+    assert(stats.lost == 1 && stats.duplicates == 1);
+    log_d(__func__, "timer test over");
+    return 0;
+}
+
+#ifdef WITH_HIDAPI
+static int test_hidapi() {
+    const Device host = {.desc = sNintendoSwitch, .func = {}};
+    // owned through the base like every impl, deleting it releases hidapi
+    std::unique_ptr<controller::ControllerImpl> a(new hidapi::HidapiImpl(&host));
+    std::unique_ptr<controller::ControllerImpl> b(new hidapi::HidapiImpl(&host));
+    assert(hidapi::HidapiImpl::Users() == 2);
+    a.reset();
+    assert(hidapi::HidapiImpl::Users() == 1);
+    b.reset();
+    assert(hidapi::HidapiImpl::Users() == 0);
+    log_d(__func__, "hidapi test over");
+    return 0;
+}
+#endif
+
+static int test_manager() {
+    static const size_t N = 32;
+    std::vector<std::unique_ptr<virtual_device::VirtualController>> vcs;
+    for (size_t i = 0; i < N; ++i)
+        vcs.emplace_back(new virtual_device::VirtualController(i & 1 ? JOYCON_R : JOYCON_L, 0));
+    controller::ControllerManager manager(2, 8);
+    // controllers on the shared reactor take no thread of their own
+    int before = threads();
+    for (size_t i = 0; i < N; ++i) {
+        const Device dev = {.desc = sNintendoSwitch, .func = vcs[i]->Func()};
+        check(manager.Add(i & 1 ? JOYCON_R : JOYCON_L, dev) != nullptr);
+    }
+    assert(threads() == before);
+    assert(manager.Size() == N);
+    controller::RunStats stats = manager.SetPlayer(PLAYER_3, PLAYER_FLASH_0);
+    assert(stats.commands == N && stats.errors == 0);
+    assert(stats.p50 <= stats.p99 && stats.p99 <= stats.max);
+    for (auto &vc : vcs)
+        assert(vc->player() == PLAYER_3);
+    stats = manager.SetImu(true);
+    assert(stats.commands == N && stats.errors == 0);
+    log_d(__func__, "%zu commands in %lu us, %.0f/s, p50 %lu us, p99 %lu us", stats.commands, stats.elapsed,
+          stats.throughput, stats.p50, stats.p99);
+    // a failing command counts against its device
+    stats = manager.Run([&manager](controller::Controller &c) {
+        return &c == manager.Get(0) ? session::ERROR : session::DONE;
+    });
+    assert(stats.errors == 1);
+    controller::DeviceStats device;
+    manager.GetStats(0, device);
+    assert(device.commands == 3 && device.errors == 1 && device.latency.count == 3);
+    assert(controller::Percentile(device.latency, 99) <= device.latency.max);
+    manager.GetStats(1, device);
+    assert(device.commands == 3 && device.errors == 0);
+    log_d(__func__, "manager test over");
+    return 0;
+}
+
+// opens its sessions over the given devices in order
+class PairImpl : public controller::ControllerImpl {
+  private:
+    std::vector<DeviceFunc> funcs_;
+    bool &deleted_;
+
+  protected:
+    session::Session *OpenDevice(unsigned int, ...) override {
+        DeviceFunc func = funcs_.front();
+        funcs_.erase(funcs_.begin());
+        return new session::Session(&func, nullptr, push_type_);
+    };
+
+  public:
+    PairImpl(const Device *host, const std::vector<DeviceFunc> &funcs, bool &deleted)
+        : ControllerImpl(host), funcs_(funcs), deleted_(deleted){};
+    ~PairImpl() { deleted_ = true; };
+};
+
+static int test_fanout() {
+    virtual_device::VirtualController left(JOYCON_L, 0), right(JOYCON_R, 0);
+    // a slow link, each report takes 10 ms to go out
+    std::vector<DeviceFunc> funcs = {left.Func(), right.Func()};
+    for (auto &func : funcs) {
+        auto sender = func.sender;
+        func.sender = [sender](const void *buffer, size_t size) -> ssize_t {
+            msleep(10);
+            return sender(buffer, size);
+        };
+    }
+    const Device host = {.desc = sNintendoSwitch, .func = {}};
+    bool deleted = false;
+    {
+        controller::JoyCon_Dual jc(new PairImpl(&host, funcs, deleted));
+        // both sides are sent at once, a command takes the slower one instead of the sum
+        uint64_t best = UINT64_MAX;
+        for (int i = 0; i < 5; i++) {
+            uint64_t begin = monotonic_ns();
+            check(jc.SetPlayer(PLAYER_4, PLAYER_FLASH_0) == session::DONE);
+            best = std::min(best, monotonic_ns() - begin);
+        }
+        assert(left.player() == PLAYER_4 && right.player() == PLAYER_4);
+        log_d(__func__, "dual command in %lu us", best / 1000);
+        assert(best < 18000000);
+    }
+    // the controller deletes its impl through the base
+    assert(deleted);
+    // both sides over one device take turns on its sender
+    {
+        static std::atomic<unsigned> inside(0), overlaps(0), sends(0);
+        const Device shared = {
+            .desc = sNintendoSwitch,
+            .func =
+                {
+                    .sender = [](const void *buffer, size_t size) -> ssize_t {
+                        if (inside++ > 0)
+                            overlaps++;
+                        msleep(1);
+                        inside--;
+                        sends++;
+                        return size;
+                    },
+                    .recver = nullptr,
+                    .send_size = OUTPUT_REPORT_SIZE,
+                    .recv_size = 0,
+                },
+        };
+        controller::JoyCon_Dual jc(shared);
+        rumble_data_t rumble;
+        bzero(&rumble, sizeof(rumble));
+        for (int i = 0; i < 8; i++)
+            check(jc.Rumble(&rumble, &rumble) == session::DONE);
+        msleep(50);
+        assert(sends == 16 && overlaps == 0);
+    }
+    log_d(__func__, "fanout test over");
+    return 0;
+}
+
+static int test_decoder() {
+    static const size_t N = 1 << 18;
+    // random reports, with known ones first
+    std::vector<InputReport> reports(N);
+    srand(1);
+    for (auto &report : reports)
+        for (auto &byte : report.raw)
+            byte = rand();
+    reports[0].controller_data.left_stick.X = 0x800;
+    reports[0].controller_data.left_stick.Y = 0x800 + 0x600;
+    reports[0].controller_data.right_stick.X = 0x800 - 0x50;
+    reports[0].controller_data.right_stick.Y = 0;
+    reports[0].controller_data.button.left = 0x12;
+    reports[0].controller_data.button.shared = 0x34;
+    reports[0].controller_data.button.right = 0x56;
+    reports[0].imu.acc_0.X = 4096;
+    reports[0].imu.gyro_2.Z = -16384;
+    struct Output {
+        std::vector<uint32_t> buttons;
+        std::vector<float> sticks[4];
+        std::vector<float> acc, gyro;
+        controller::ReportBatch batch;
+        Output() : buttons(N), acc(N * controller::DECODE_IMU_VALUES), gyro(N * controller::DECODE_IMU_VALUES) {
+            for (auto &stick : sticks)
+                stick.resize(N);
+            batch = {buttons.data(), sticks[0].data(), sticks[1].data(), sticks[2].data(),
+                     sticks[3].data(), acc.data(), gyro.data()};
+        };
+    };
+    controller::ReportDecoder decoder;
+    const controller::ReportDecoder::Kernel kernels[] = {controller::ReportDecoder::SCALAR,
+                                                         controller::ReportDecoder::SSE2,
+                                                         controller::ReportDecoder::AVX2};
+    std::unique_ptr<Output> expect;
+    for (auto kernel : kernels) {
+        if (!decoder.SetKernel(kernel))
+            continue;
+        std::unique_ptr<Output> output(new Output());
+        // a stride that is not the report size
+        uint64_t begin = monotonic_ns();
+        decoder.Decode(reports.data(), sizeof(InputReport), N - 3, output->batch);
+        uint64_t ns = monotonic_ns() - begin;
+        log_d(__func__, "kernel %d, %.1f ns/report", kernel, static_cast<double>(ns) / N);
+        if (!expect) {
+            assert(output->buttons[0] == 0x563412);
+            assert(output->sticks[0][0] == 0 && output->sticks[1][0] == 1.0f);
+            assert(output->sticks[2][0] == 0 && output->sticks[3][0] == -1.0f);
+            assert(output->acc[0] == 4096 * controller::ACC_SCALE_DEFAULT);
+            assert(output->gyro[8] == -16384 * controller::GYRO_SCALE_DEFAULT);
+            expect = std::move(output);
+            continue;
+        }
+        // every kernel agrees with the scalar one, the last reports are left alone
+        assert(output->buttons == expect->buttons);
+        for (int i = 0; i < 4; ++i)
+            assert(output->sticks[i] == expect->sticks[i]);
+        assert(output->acc == expect->acc && output->gyro == expect->gyro);
+        assert(output->sticks[0][N - 1] == 0 && output->acc[N * controller::DECODE_IMU_VALUES - 1] == 0);
+    }
+    log_d(__func__, "decoder test over");
+    return 0;
+}
+
 static int test_dual() {
     int ret = 0;
     auto jc = controller::JoyCon_Dual(nullptr);
@@ -146,7 +1480,28 @@ static int test_dual() {
 int main() {
     std::cout << "hello test c++" << std::endl;
     int ret = 0;
-    ret = test_session();
+    ret |= test_session();
+    ret |= test_route();
+    ret |= test_alloc();
+    ret |= test_push();
+    ret |= test_queued();
+    ret |= test_link();
+    ret |= test_pipeline();
+    ret |= test_batch();
+    ret |= test_teardown();
+    ret |= test_reactor();
+    ret |= test_hidraw();
+    ret |= test_virtual();
+    ret |= test_capture();
+    ret |= test_feed();
+    ret |= test_buttons();
+    ret |= test_timer();
+    ret |= test_manager();
+    ret |= test_fanout();
+    ret |= test_decoder();
+#ifdef WITH_HIDAPI
+    ret |= test_hidapi();
+#endif
     return ret;
 }
 